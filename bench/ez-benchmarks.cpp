@@ -0,0 +1,245 @@
+// Rough benchmarks for the hot paths. Build with -DEZ_BUILD_BENCHMARKS=ON.
+// Usage: ez_benchmarks [filter] [--quick]
+// Only benchmarks whose name contains the filter string are run.
+// Latencies are per operation, measured with steady_clock around each call,
+// so the smallest numbers are dominated by the cost of reading the clock.
+// Compare runs on the same machine rather than reading too much into the
+// absolute numbers.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <ez.hpp>
+#include <ez-beach.hpp>
+
+#if defined(_WIN32)
+#	include <windows.h>
+#elif defined(__linux__)
+#	include <pthread.h>
+#	include <sched.h>
+#endif
+
+namespace bench {
+
+using clock = std::chrono::steady_clock;
+
+static bool quick = false;
+
+static auto pin_to_core(unsigned core) -> void {
+	const auto cores = std::max(1u, std::thread::hardware_concurrency());
+	core %= cores;
+#if defined(_WIN32)
+	SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	static_cast<void>(core);
+#endif
+}
+
+[[nodiscard]] static
+auto ns_since(clock::time_point t0) -> double {
+	return std::chrono::duration<double, std::nano>(clock::now() - t0).count();
+}
+
+// Collects latency samples and prints percentiles plus a log2 histogram.
+struct histogram {
+	histogram(size_t reserve) { samples_.reserve(reserve); }
+	auto add(double ns) -> void { samples_.push_back(ns); }
+	auto merge(const histogram& other) -> void { samples_.insert(samples_.end(), other.samples_.begin(), other.samples_.end()); }
+	auto print(const char* label) -> void {
+		if (samples_.empty()) { return; }
+		std::sort(samples_.begin(), samples_.end());
+		std::printf("  %-28s n=%-9zu p50=%-9.0f p99=%-9.0f p99.9=%-9.0f max=%.0f (ns)\n",
+			label, samples_.size(), percentile(0.5), percentile(0.99), percentile(0.999), samples_.back());
+		std::array<size_t, 32> buckets{};
+		for (const auto ns : samples_) {
+			auto bucket = size_t(0);
+			while (bucket + 1 < buckets.size() && double(uint64_t(1) << (bucket + 1)) <= ns) { bucket++; }
+			buckets[bucket]++;
+		}
+		const auto peak = *std::max_element(buckets.begin(), buckets.end());
+		for (size_t i = 0; i < buckets.size(); i++) {
+			if (buckets[i] == 0) { continue; }
+			const auto bar = std::max(size_t(1), buckets[i] * 40 / peak);
+			std::printf("    %10llu ns | %-40s %zu\n", (unsigned long long)(uint64_t(1) << i), std::string(bar, '#').c_str(), buckets[i]);
+		}
+	}
+private:
+	auto percentile(double p) const -> double {
+		return samples_[std::min(samples_.size() - 1, size_t(p * double(samples_.size())))];
+	}
+	std::vector<double> samples_;
+};
+
+struct small_value { int x = 0; };
+struct large_value { std::array<float, 4096> x{}; };
+
+// value::read latency ----------------------------------------------------
+
+template <typename Value>
+static auto read_latency(const char* policy) -> void {
+	const auto reads_per_thread = size_t(quick ? 20'000 : 200'000);
+	for (const auto readers : {1, 2, 4, 8, 16}) {
+		Value v;
+		v.set(ez::nort, small_value{});
+		std::atomic_bool stop = false;
+		std::atomic<int> ready = 0;
+		// A writer and a garbage collector running the whole time, because
+		// that is the situation the readers have to cope with.
+		auto writer = std::thread{[&] {
+			pin_to_core(0);
+			for (int i = 0; !stop.load(std::memory_order_relaxed); i++) {
+				v.set(ez::nort, small_value{i});
+				std::this_thread::sleep_for(std::chrono::microseconds{50});
+			}
+		}};
+		auto collector = std::thread{[&] {
+			while (!stop.load(std::memory_order_relaxed)) {
+				v.garbage_collect(ez::gc);
+				std::this_thread::sleep_for(std::chrono::microseconds{200});
+			}
+		}};
+		std::vector<histogram> results(size_t(readers), histogram{reads_per_thread});
+		std::vector<std::thread> threads;
+		for (int r = 0; r < readers; r++) {
+			threads.emplace_back([&, r] {
+				pin_to_core(unsigned(r + 1));
+				ez::hazard_register(ez::nort);
+				ready++;
+				while (ready.load() < readers) { std::this_thread::yield(); }
+				auto sink = 0;
+				for (size_t i = 0; i < reads_per_thread; i++) {
+					const auto t0 = clock::now();
+					sink += v.read(ez::safe)->x;
+					results[size_t(r)].add(ns_since(t0));
+				}
+				static_cast<void>(sink);
+			});
+		}
+		for (auto& t : threads) { t.join(); }
+		stop = true;
+		writer.join();
+		collector.join();
+		for (size_t r = 1; r < results.size(); r++) { results[0].merge(results[r]); }
+		const auto label = std::string{policy} + ", " + std::to_string(readers) + " readers";
+		results[0].print(label.c_str());
+	}
+}
+
+// sync::publish throughput -----------------------------------------------
+
+template <typename T, typename... Policies>
+static auto publish_throughput(const char* label) -> void {
+	const auto publishes = size_t(quick ? 20'000 : 200'000);
+	ez::sync<T, false, Policies...> s;
+	std::atomic_bool stop = false;
+	auto collector = std::thread{[&] {
+		while (!stop.load(std::memory_order_relaxed)) {
+			s.gc(ez::gc);
+			std::this_thread::yield();
+		}
+	}};
+	histogram h{publishes};
+	const auto start = clock::now();
+	for (size_t i = 0; i < publishes; i++) {
+		const auto t0 = clock::now();
+		s.update_publish(ez::nort, [](T&& x) { return std::move(x); });
+		h.add(ns_since(t0));
+	}
+	const auto elapsed = ns_since(start);
+	stop = true;
+	collector.join();
+	std::printf("  %-28s %.0f publishes/s\n", label, double(publishes) / (elapsed / 1e9));
+	h.print(label);
+}
+
+// value::garbage_collect cost --------------------------------------------
+
+static auto gc_cost() -> void {
+	for (const auto live : {1, 16, 256, 4096}) {
+		histogram h{64};
+		for (int pass = 0; pass < (quick ? 8 : 64); pass++) {
+			ez::value<small_value> v;
+			v.reserve(ez::nort, size_t(live) * 2);
+			std::vector<ez::immutable<small_value>> held;
+			held.reserve(size_t(live));
+			// Half the versions are still referenced by a reader, half are
+			// garbage.
+			for (int i = 0; i < live; i++) {
+				v.set(ez::nort, small_value{i});
+				held.push_back(v.read(ez::safe));
+				v.set(ez::nort, small_value{i});
+			}
+			const auto t0 = clock::now();
+			v.garbage_collect(ez::gc);
+			h.add(ns_since(t0));
+		}
+		const auto label = std::to_string(live) + " live + " + std::to_string(live) + " dead";
+		h.print(label.c_str());
+	}
+}
+
+// beach_ball round trip --------------------------------------------------
+
+static auto beach_ball_round_trip() -> void {
+	const auto round_trips = size_t(quick ? 2'000 : 200'000);
+	ez::beach_ball<ez::player_count{2}> ball{ez::catcher{0}};
+	histogram h{round_trips};
+	auto other = std::thread{[&] {
+		pin_to_core(2);
+		auto player = ball.make_player<1>();
+		for (size_t i = 0; i < round_trips; i++) {
+			while (!player.catch_ball()) {}
+			player.throw_to<ez::catcher{0}>();
+		}
+	}};
+	pin_to_core(1);
+	auto player = ball.make_player<0>();
+	while (!player.catch_ball()) {}
+	for (size_t i = 0; i < round_trips; i++) {
+		const auto t0 = clock::now();
+		player.throw_to<ez::catcher{1}>();
+		while (!player.catch_ball()) {}
+		h.add(ns_since(t0));
+	}
+	other.join();
+	h.print("core 1 <-> core 2");
+}
+
+} // bench
+
+auto main(int argc, char* argv[]) -> int {
+	const char* filter = "";
+	for (int i = 1; i < argc; i++) {
+		if (std::strcmp(argv[i], "--quick") == 0) { bench::quick = true; }
+		else                                      { filter = argv[i]; }
+	}
+	const std::pair<const char*, std::function<void()>> benchmarks[] = {
+		{"read/refcount",     [] { bench::read_latency<ez::value<bench::small_value>>("refcount"); }},
+		{"read/hazard",       [] { bench::read_latency<ez::value<bench::small_value, false, ez::hazard>>("hazard"); }},
+		{"publish/small",     [] { bench::publish_throughput<bench::small_value>("small T (4 bytes)"); }},
+		{"publish/inline",    [] { bench::publish_throughput<bench::small_value, ez::inline_storage>("small T (4 bytes), inline storage"); }},
+		{"publish/large",     [] { bench::publish_throughput<bench::large_value>("large T (16 KB)"); }},
+		{"gc",                [] { bench::gc_cost(); }},
+		{"beach_ball",        [] { bench::beach_ball_round_trip(); }},
+	};
+	for (const auto& [name, fn] : benchmarks) {
+		if (!std::strstr(name, filter)) { continue; }
+		std::printf("%s\n", name);
+		fn();
+	}
+	return 0;
+}
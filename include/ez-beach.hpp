@@ -1,6 +1,16 @@
 #pragma once
 
+#include "ez-cpu.hpp"
+#include "ez-tags.hpp"
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cassert>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
 
 namespace ez {
 
@@ -9,6 +19,60 @@ struct player       { int v = -1; };
 struct thrower      { int v = -1; };
 struct player_count { int v = -1; };
 
+namespace detail {
+
+// The state shared by all the players of a ball. It gets a cache line of
+// its own so that it doesn't share one with whatever the ball is
+// protecting.
+// Non-realtime players can sleep until the ball is thrown to them with
+// wait_for(). Throwing only makes a system call to wake them when the
+// player it is thrown to is actually waiting, so a realtime thread can keep
+// throwing as long as none of the players it throws to are waiting, even if
+// others are. Waiters are counted per player, except that with more than
+// MAX_COUNTED players some of them share a count, which only costs the
+// occasional unnecessary wake-up.
+struct alignas(cache_line_size) ball_state {
+	ball_state(catcher first_catcher) {
+		// Ball starts in the air, thrown to the first catcher
+		thrown_to_.store(first_catcher.v, std::memory_order_relaxed);
+	}
+	auto throw_to(catcher c) -> void {
+		// Either we see the waiter here or the waiter sees the ball after
+		// announcing itself, so nobody sleeps through a throw.
+		thrown_to_.store(c.v, std::memory_order_seq_cst);
+		if (waiters(c).load(std::memory_order_seq_cst) > 0) {
+			// Everyone waits on the same atomic, so wake them all and let
+			// the ones who weren't thrown to go back to sleep.
+			thrown_to_.notify_all();
+		}
+	}
+	auto catch_ball(catcher c) -> bool {
+		int tmp = c.v;
+		return thrown_to_.compare_exchange_strong(tmp, catcher{}.v, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+	auto wait_for(catcher c) -> void {
+		waiters(c).fetch_add(1, std::memory_order_seq_cst);
+		for (;;) {
+			auto thrown_to = thrown_to_.load(std::memory_order_seq_cst);
+			if (thrown_to == c.v) {
+				if (thrown_to_.compare_exchange_strong(thrown_to, catcher{}.v, std::memory_order_acquire, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			thrown_to_.wait(thrown_to, std::memory_order_seq_cst);
+		}
+		waiters(c).fetch_sub(1, std::memory_order_relaxed);
+	}
+private:
+	static constexpr int MAX_COUNTED = 16;
+	auto waiters(catcher c) -> std::atomic<int>& { return waiters_[size_t(c.v % MAX_COUNTED)]; }
+	std::atomic<int> thrown_to_;
+	// Number of threads currently sleeping in wait_for(), for each player.
+	std::array<std::atomic<int>, MAX_COUNTED> waiters_{};
+};
+
+} // detail
+
 template <player_count PlayerCount, player Player> struct beach_ball_player;
 
 // Ball thrown between two or more players.
@@ -17,16 +81,17 @@ template <player_count PlayerCount, player Player> struct beach_ball_player;
 // Only the player currently holding the ball is
 // allowed to access the resource..
 // Each player must poll by calling catch_ball(), to check
-// if the ball has been thrown to them yet.
+// if the ball has been thrown to them yet, or, if they aren't
+// a realtime thread, block in wait_for_ball() until it is.
 // Calling throw_ball() when you don't have the ball is invalid.
 template <player_count PlayerCount>
 struct beach_ball {
 	static_assert(PlayerCount.v > 1);
 	template <int Player> using player = beach_ball_player<PlayerCount, ez::player{Player}>;
-	beach_ball(catcher first_catcher) {
+	beach_ball(catcher first_catcher)
+		: state_{first_catcher}
+	{
 		assert(first_catcher.v >= 0 && first_catcher.v < PlayerCount.v);
-		// Ball starts in the air, thrown to the first catcher
-		thrown_to_.store(first_catcher.v, std::memory_order_relaxed);
 	}
 	template <int Player>
 	auto make_player() -> player<Player> {
@@ -40,18 +105,23 @@ struct beach_ball {
 		static_assert(Thrower.v >= 0 && Thrower.v < PlayerCount.v);
 		static_assert(Catcher.v >= 0 && Catcher.v < PlayerCount.v);
 		static_assert(Thrower.v != Catcher.v, "Can't throw ball to yourself!");
-		thrown_to_.store(Catcher.v, std::memory_order_release);
+		state_.throw_to(Catcher);
 	}
 	// Returns true if the ball is caught.
 	// Returns false if the ball has not been thrown to this player.
 	template <catcher Catcher>
 	auto catch_ball() -> bool {
 		static_assert(Catcher.v >= 0 && Catcher.v < PlayerCount.v);
-		int tmp = Catcher.v;
-		return thrown_to_.compare_exchange_strong(tmp, catcher{}.v, std::memory_order_acquire, std::memory_order_relaxed);
+		return state_.catch_ball(Catcher);
+	}
+	// Block until the ball is thrown to this player, and catch it.
+	template <catcher Catcher>
+	auto wait_for_ball(ez::nort_t) -> void {
+		static_assert(Catcher.v >= 0 && Catcher.v < PlayerCount.v);
+		state_.wait_for(Catcher);
 	}
 private:
-	std::atomic<int> thrown_to_;
+	detail::ball_state state_;
 };
 
 template <player_count PlayerCount, player Player>
@@ -80,6 +150,13 @@ struct beach_ball_player {
 		}
 		return have_ball_;
 	} 
+	auto wait_for_ball(ez::nort_t) -> void {
+		if (have_ball_) {
+			throw std::logic_error{"Tried to catch ball but we already have it!"};
+		}
+		ball->template wait_for_ball<catcher{Player.v}>(ez::nort);
+		have_ball_ = true;
+	}
 	auto have_ball() const -> bool {
 		return have_ball_;
 	}
@@ -102,4 +179,292 @@ private:
 	bool have_ball_{};
 };
 
+struct dynamic_beach_ball_player;
+
+// Like beach_ball, except the number of players is only known at runtime,
+// e.g. a pool of worker threads sized to the number of cores. The players
+// are numbered 0 to player_count - 1 and the indices are checked with
+// assertions rather than at compile time.
+// Catching the ball is still a single compare-and-swap on one atomic int,
+// whatever the number of players.
+// throw_to_next() throws the ball to the next player along, wrapping
+// around at the end, so if every player does that then they each get a
+// turn in order.
+struct dynamic_beach_ball {
+	dynamic_beach_ball(int player_count, catcher first_catcher)
+		: player_count_{player_count}
+		, state_{first_catcher}
+	{
+		assert(player_count > 1);
+		assert(first_catcher.v >= 0 && first_catcher.v < player_count);
+	}
+	[[nodiscard]] auto player_count() const -> int { return player_count_; }
+	auto make_player(player p) -> dynamic_beach_ball_player;
+	// We're not allowed to call this unless we have the ball,
+	// i.e. catch_ball() must have returned true since our
+	// last call to throw_ball().
+	auto throw_to(thrower t, catcher c) -> void {
+		assert(t.v >= 0 && t.v < player_count_);
+		assert(c.v >= 0 && c.v < player_count_);
+		assert(t.v != c.v && "Can't throw ball to yourself!");
+		static_cast<void>(t);
+		state_.throw_to(c);
+	}
+	auto throw_to_next(thrower t) -> void {
+		throw_to(t, next_after(t));
+	}
+	// Returns true if the ball is caught.
+	// Returns false if the ball has not been thrown to this player.
+	auto catch_ball(catcher c) -> bool {
+		assert(c.v >= 0 && c.v < player_count_);
+		return state_.catch_ball(c);
+	}
+	// Block until the ball is thrown to this player, and catch it.
+	auto wait_for_ball(ez::nort_t, catcher c) -> void {
+		assert(c.v >= 0 && c.v < player_count_);
+		state_.wait_for(c);
+	}
+	[[nodiscard]] auto next_after(thrower t) const -> catcher {
+		return catcher{t.v + 1 < player_count_ ? t.v + 1 : 0};
+	}
+private:
+	const int player_count_;
+	detail::ball_state state_;
+};
+
+struct dynamic_beach_ball_player {
+	dynamic_beach_ball* const ball;
+	const player index;
+	dynamic_beach_ball_player(dynamic_beach_ball* ball_, player index_)
+		: ball{ ball_ }
+		, index{ index_ }
+	{
+		assert(index.v >= 0 && index.v < ball->player_count());
+	}
+	auto throw_to(catcher c) -> void {
+		if (!have_ball_) {
+			throw std::logic_error{"Tried to throw ball but we don't have it!"};
+		}
+		have_ball_ = false;
+		ball->throw_to(thrower{index.v}, c);
+	}
+	auto throw_to_next() -> void {
+		throw_to(ball->next_after(thrower{index.v}));
+	}
+	auto catch_ball() -> bool {
+		if (have_ball_) {
+			throw std::logic_error{"Tried to catch ball but we already have it!"};
+		}
+		if (ball->catch_ball(catcher{index.v})) {
+			have_ball_ = true;
+		}
+		return have_ball_;
+	}
+	auto wait_for_ball(ez::nort_t) -> void {
+		if (have_ball_) {
+			throw std::logic_error{"Tried to catch ball but we already have it!"};
+		}
+		ball->wait_for_ball(ez::nort, catcher{index.v});
+		have_ball_ = true;
+	}
+	auto have_ball() const -> bool {
+		return have_ball_;
+	}
+	auto ensure() -> bool {
+		if (!have_ball_) {
+			if (!catch_ball()) return false;
+		}
+		return true;
+	}
+	auto with_ball(catcher if_success_then_throw_to, auto&& fn) -> bool {
+		if (ensure()) {
+			fn();
+			throw_to(if_success_then_throw_to);
+			return true;
+		}
+		return false;
+	}
+	auto with_ball_then_next(auto&& fn) -> bool {
+		if (ensure()) {
+			fn();
+			throw_to_next();
+			return true;
+		}
+		return false;
+	}
+private:
+	bool have_ball_{};
+};
+
+inline
+auto dynamic_beach_ball::make_player(player p) -> dynamic_beach_ball_player {
+	return dynamic_beach_ball_player{this, p};
+}
+
+// A half-open range of indices [begin, end).
+struct index_range {
+	size_t begin = 0;
+	size_t end   = 0;
+};
+
+namespace detail {
+
+// A sorted set of non-overlapping ranges. Ranges which overlap or touch are
+// merged as they are added. If adding a range would make more than N of
+// them then the two ranges with the smallest gap between them are merged,
+// so the set never allocates, at the cost of sometimes covering a bit more
+// than was actually added.
+template <size_t N>
+struct range_set {
+	static_assert(N > 0);
+	auto add(index_range r) -> void {
+		if (r.begin >= r.end) { return; }
+		auto first = size_t(0);
+		while (first < count_ && ranges_[first].end < r.begin) { first++; }
+		auto last = first;
+		while (last < count_ && ranges_[last].begin <= r.end) {
+			r.begin = std::min(r.begin, ranges_[last].begin);
+			r.end   = std::max(r.end, ranges_[last].end);
+			last++;
+		}
+		if (first == last) {
+			std::copy_backward(ranges_.begin() + first, ranges_.begin() + count_, ranges_.begin() + count_ + 1);
+			count_++;
+		}
+		else {
+			std::copy(ranges_.begin() + last, ranges_.begin() + count_, ranges_.begin() + first + 1);
+			count_ -= last - first - 1;
+		}
+		ranges_[first] = r;
+		if (count_ > N) { merge_closest(); }
+	}
+	auto add(const range_set& other) -> void {
+		for (const auto& r : other.get()) { add(r); }
+	}
+	auto clear() -> void                                    { count_ = 0; }
+	[[nodiscard]] auto empty() const -> bool                { return count_ == 0; }
+	[[nodiscard]] auto get() const -> std::span<const index_range> { return {ranges_.data(), count_}; }
+private:
+	auto merge_closest() -> void {
+		auto best = size_t(0);
+		for (size_t i = 1; i + 1 < count_; i++) {
+			if (ranges_[i + 1].begin - ranges_[i].end < ranges_[best + 1].begin - ranges_[best].end) { best = i; }
+		}
+		ranges_[best].end = ranges_[best + 1].end;
+		std::copy(ranges_.begin() + best + 2, ranges_.begin() + count_, ranges_.begin() + best + 1);
+		count_--;
+	}
+	// One spare so that add() can insert before merging.
+	std::array<index_range, N + 1> ranges_;
+	size_t count_ = 0;
+};
+
+} // detail
+
+// A buffer shared between a writer and a reader who take turns with it
+// using a beach ball, e.g. the audio thread capturing sample data and the
+// UI thread generating waveform mipmaps from it. This is the situation
+// described in the README, with the dirty region bookkeeping done for you.
+// The writer has a private copy of the buffer and always writes there, and
+// the regions it writes to are recorded. When the writer calls flush() and
+// manages to catch the ball, just the dirty regions are copied into the
+// shared buffer and the ball is thrown to the reader along with the list of
+// regions which changed. If it doesn't have the ball then flush() does
+// nothing and the regions keep accumulating until next time.
+// The reader gets to look at the shared buffer in place, along with the
+// dirty regions, and then the ball goes back to the writer.
+// At most MaxRanges dirty regions are tracked. If there are more than that
+// then nearby regions are merged together.
+// Nothing here allocates except the constructor, and everything except
+// wait_and_read() is realtime-safe.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::beach_buffer<float> capture{SAMPLE_COUNT};
+
+void audio_callback(...) {
+	capture.write(ez::audio, write_pos, input);
+	capture.flush(ez::audio);
+}
+
+void ui_frame() {
+	capture.read(ez::ui, [](std::span<const float> samples, std::span<const ez::index_range> dirty) {
+		for (const auto& r : dirty) {
+			update_mipmaps(samples, r);
+		}
+	});
+}
+---------------------------------------------------------------------- */
+template <typename T, size_t MaxRanges = 16>
+struct beach_buffer {
+	static_assert(std::is_trivially_copyable_v<T>);
+	beach_buffer(size_t size)
+		: writer_{&ball_}
+		, staging_(size)
+		, reader_{&ball_}
+		, shared_(size)
+	{
+	}
+	[[nodiscard]] auto size() const -> size_t { return shared_.size(); }
+	// Writer ------------------------------------------------------------
+	// The writer's private copy. If you write to this directly then call
+	// mark_dirty() for whatever you changed.
+	[[nodiscard]] auto staging(ez::safe_t) -> std::span<T> { return staging_; }
+	auto mark_dirty(ez::safe_t, index_range r) -> void {
+		assert (r.end <= size());
+		dirty_.add(r);
+	}
+	auto write(ez::safe_t, size_t pos, std::span<const T> data) -> void {
+		assert (pos + data.size() <= size());
+		std::memcpy(staging_.data() + pos, data.data(), data.size_bytes());
+		dirty_.add({pos, pos + data.size()});
+	}
+	// Returns true if anything was handed over to the reader.
+	auto flush(ez::safe_t) -> bool {
+		if (dirty_.empty())     { return false; }
+		if (!writer_.ensure())  { return false; }
+		for (const auto& r : dirty_.get()) {
+			std::memcpy(shared_.data() + r.begin, staging_.data() + r.begin, (r.end - r.begin) * sizeof(T));
+		}
+		shared_dirty_.add(dirty_);
+		dirty_.clear();
+		writer_.template throw_to<READER>();
+		return true;
+	}
+	// Reader ------------------------------------------------------------
+	// If the writer has handed something over then call
+	// fn(std::span<const T> buffer, std::span<const index_range> dirty)
+	// and return true. Otherwise return false.
+	template <typename Fn>
+	auto read(ez::safe_t, Fn&& fn) -> bool {
+		if (!reader_.catch_ball()) { return false; }
+		consume(std::forward<Fn>(fn));
+		return true;
+	}
+	// Like read() but sleeps until the writer hands something over.
+	template <typename Fn>
+	auto wait_and_read(ez::nort_t, Fn&& fn) -> void {
+		reader_.wait_for_ball(ez::nort);
+		consume(std::forward<Fn>(fn));
+	}
+private:
+	static constexpr auto WRITER = catcher{0};
+	static constexpr auto READER = catcher{1};
+	template <typename Fn>
+	auto consume(Fn&& fn) -> void {
+		fn(std::span<const T>{shared_}, shared_dirty_.get());
+		shared_dirty_.clear();
+		reader_.template throw_to<WRITER>();
+	}
+	beach_ball<player_count{2}> ball_{WRITER};
+	// Writer only.
+	alignas(cache_line_size) beach_ball_player<player_count{2}, player{WRITER.v}> writer_;
+	detail::range_set<MaxRanges> dirty_;
+	std::vector<T> staging_;
+	// Reader only.
+	alignas(cache_line_size) beach_ball_player<player_count{2}, player{READER.v}> reader_;
+	// Whoever has the ball.
+	alignas(cache_line_size) std::vector<T> shared_;
+	detail::range_set<MaxRanges> shared_dirty_;
+};
+
 } // ez
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#	include <intrin.h>
+#endif
+
+namespace ez {
+
+// The size and alignment to use to keep things which are written by
+// different threads off each other's cache lines. You can define
+// EZ_CACHE_LINE_SIZE to override it, which you might want to do if you are
+// sharing ez types across a library boundary, because the standard value
+// is allowed to differ between compilers and tuning flags.
+#if defined(EZ_CACHE_LINE_SIZE)
+inline constexpr size_t cache_line_size = EZ_CACHE_LINE_SIZE;
+#elif defined(__cpp_lib_hardware_interference_size)
+#	if defined(__GNUC__) && !defined(__clang__)
+#		pragma GCC diagnostic push
+#		pragma GCC diagnostic ignored "-Winterference-size"
+#	endif
+inline constexpr size_t cache_line_size = std::hardware_destructive_interference_size;
+#	if defined(__GNUC__) && !defined(__clang__)
+#		pragma GCC diagnostic pop
+#	endif
+#elif defined(__APPLE__) && defined(__aarch64__)
+inline constexpr size_t cache_line_size = 128;
+#else
+inline constexpr size_t cache_line_size = 64;
+#endif
+
+// Gives a T at least one cache line to itself, so that it doesn't falsely
+// share one with its neighbours. E.g. if the audio thread is reading from a
+// sync for each voice, and the UI thread is publishing to them, then a
+// plain array of syncs would have the voices fighting over cache lines
+// they have nothing to do with.
+template <typename T>
+struct alignas(cache_line_size) padded {
+	padded() = default;
+	template <typename... Args>
+	explicit padded(std::in_place_t, Args&&... args) : value(std::forward<Args>(args)...) {}
+	auto operator*() -> T&              { return value; }
+	auto operator*() const -> const T&  { return value; }
+	auto operator->() -> T*             { return &value; }
+	auto operator->() const -> const T* { return &value; }
+	T value;
+};
+
+// N padded Ts, all constructed with the same arguments.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::sync_signal signal;
+static ez::padded_array<ez::signalled_sync<voice_params>, 128> voices{signal};
+
+void audio_callback(...) {
+	for (auto& voice : voices) {
+		const auto& params = *voice->read(ez::audio);
+	}
+}
+---------------------------------------------------------------------- */
+template <typename T, size_t N>
+struct padded_array {
+	template <typename... Args>
+	padded_array(const Args&... args) : padded_array{std::make_index_sequence<N>{}, args...} {}
+	[[nodiscard]] static constexpr auto size() -> size_t { return N; }
+	auto operator[](size_t i) -> T&             { return elements_[i].value; }
+	auto operator[](size_t i) const -> const T& { return elements_[i].value; }
+	auto begin()       { return elements_.begin(); }
+	auto end()         { return elements_.end(); }
+	auto begin() const { return elements_.begin(); }
+	auto end() const   { return elements_.end(); }
+private:
+	template <size_t... I, typename... Args>
+	padded_array(std::index_sequence<I...>, const Args&... args)
+		: elements_{{(static_cast<void>(I), padded<T>{std::in_place, args...})...}}
+	{
+	}
+	std::array<padded<T>, N> elements_;
+};
+
+} // ez
+
+namespace ez::detail {
+
+// Tell the CPU we are spinning on something, so it can go easy on the
+// power and the memory bus, and give a hyperthreaded sibling a go.
+inline
+auto cpu_relax() -> void {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield");
+#endif
+}
+
+} // ez::detail
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "ez.hpp"
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <tuple>
+
+namespace ez {
+
+// A value which is a pure function of some other values, e.g. a compiled
+// DSP graph derived from the track list and the routing.
+// update() checks the generations of the sources and, only if any of them
+// have changed since last time, reads the published version of each one,
+// calls the function and publishes the result. Any number of changes to
+// the sources between two calls to update() result in a single
+// recomputation.
+// Either call update() from a thread of your own, or call start() to have
+// a thread belonging to the derived value poll the sources.
+// The thread polls rather than being woken by the sources because a source
+// doesn't know what depends on it, and keeping a list of listeners to
+// notify would put a lock or an allocation into every publish. An idle poll
+// is one wait-free generation() load per source. To react sooner than the
+// next poll, call notify() after publishing to a source.
+// Sources can be anything with generation() and snapshot(), i.e. ez::value,
+// ez::sync and everything derived from them, and other ez::deriveds. The
+// function sees what has been published to the sources, not their working
+// values.
+// Realtime readers read the result the same way they would read a sync.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::sync<Tracks> tracks;
+static ez::sync<Routing> routing;
+static ez::derived<Graph, ez::sync<Tracks>, ez::sync<Routing>> graph{&compile_graph, tracks, routing};
+
+void init() {
+	graph.start(ez::main, std::chrono::milliseconds{20});
+}
+
+void audio_thread() {
+	auto g = graph.read(ez::audio);
+	g->process(...);
+}
+---------------------------------------------------------------------- */
+// The function is called once in the constructor, so the sources must have
+// something published by then. It runs on whichever thread calls update(),
+// and never on more than one at once.
+// CAUTION:
+// The sources must outlive the derived value.
+template <typename T, typename... Sources>
+struct derived {
+	static_assert(sizeof...(Sources) > 0);
+	using value_type = T;
+	using ref_type   = typename ez::value<T, true>::ref_type;
+	using fn_type    = std::function<T(const typename Sources::value_type&...)>;
+	derived(fn_type fn, Sources&... sources) : fn_{std::move(fn)}, sources_{&sources...} {
+		recompute();
+	}
+	derived(const derived&) = delete;
+	derived& operator=(const derived&) = delete;
+	~derived() { stop(ez::nort); }
+	[[nodiscard]] auto read(ez::rt_t) const -> ref_type                     { return value_.read(ez::safe); }
+	[[nodiscard]] auto snapshot(ez::nort_t) const -> ez::snapshot<ref_type> { return value_.snapshot(ez::safe); }
+	[[nodiscard]] auto generation(ez::safe_t) const -> uint64_t             { return value_.generation(ez::safe); }
+	// Versions of the result are collected whenever it is recomputed. Old
+	// ones which were still being read at the time are left until the next
+	// recomputation, unless you call this or register with a gc_scheduler.
+	auto gc(ez::gc_t) -> void                                               { value_.garbage_collect(ez::gc); }
+	// Not for public use. See gc_scheduler.
+	[[nodiscard]] auto gc_client(ez::nort_t) -> detail::gc_client&          { return value_.gc_client(ez::nort); }
+	// Recompute the value if any of the sources have been published to
+	// since the last time. Returns true if it was recomputed.
+	auto update(ez::nort_t) -> bool {
+		auto lock = std::lock_guard{mutex_};
+		if (!changed()) { return false; }
+		recompute();
+		return true;
+	}
+	// Start a thread which calls update() every 'period'. Does nothing if the
+	// thread is already running.
+	auto start(ez::nort_t, std::chrono::nanoseconds period) -> void {
+		auto lock = std::lock_guard{thread_mutex_};
+		if (thread_.joinable()) { return; }
+		stop_ = false;
+		thread_ = std::thread{[this, period] {
+			auto lock = std::unique_lock{thread_mutex_};
+			for (;;) {
+				cv_.wait_for(lock, period, [this] { return stop_ || wake_; });
+				if (stop_) { return; }
+				wake_ = false;
+				lock.unlock();
+				update(ez::nort);
+				lock.lock();
+			}
+		}};
+	}
+	// Have the thread started by start() check the sources now rather than
+	// at the end of the current period. Does nothing if it isn't running.
+	auto notify(ez::nort_t) -> void {
+		{
+			auto lock = std::lock_guard{thread_mutex_};
+			wake_ = true;
+		}
+		cv_.notify_one();
+	}
+	// Stop the thread started by start(), if there is one, and wait for it
+	// to finish.
+	auto stop(ez::nort_t) -> void {
+		{
+			auto lock = std::lock_guard{thread_mutex_};
+			if (!thread_.joinable()) { return; }
+			stop_ = true;
+		}
+		cv_.notify_one();
+		thread_.join();
+	}
+private:
+	static constexpr auto N = sizeof...(Sources);
+	auto changed() const -> bool {
+		return [this]<size_t... I>(std::index_sequence<I...>) {
+			return ((std::get<I>(sources_)->generation(ez::safe) != seen_[I]) || ...);
+		}(std::make_index_sequence<N>{});
+	}
+	auto recompute() -> void {
+		[this]<size_t... I>(std::index_sequence<I...>) {
+			// Hold on to the snapshots so that the generations recorded are
+			// the ones the function actually saw.
+			const auto snaps = std::make_tuple(std::get<I>(sources_)->snapshot(ez::nort)...);
+			((seen_[I] = std::get<I>(snaps).generation), ...);
+			value_.set(ez::nort, fn_(*std::get<I>(snaps)...));
+		}(std::make_index_sequence<N>{});
+	}
+	fn_type fn_;
+	std::tuple<Sources*...> sources_;
+	std::array<uint64_t, N> seen_{};
+	detail::checked_mutex mutex_;
+	ez::value<T, true> value_;
+	std::mutex thread_mutex_;
+	std::condition_variable cv_;
+	std::thread thread_;
+	bool stop_ = false;
+	bool wake_ = false;
+};
+
+} // ez
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "ez-cpu.hpp"
+#include "ez-tags.hpp"
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace ez {
+
+// Events are like ez::trigger but with stronger guarantees. Firing one is
+// a release and noticing it is an acquire, so whatever the firing thread
+// wrote before firing is visible to the thread which notices it, e.g. a
+// small message it left in a plain variable or a queue.
+// Everything here is lock-free and realtime-safe from any thread.
+
+// Any number of fires between two checks are seen as one. There may only
+// be one consumer.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::coalescing_event panic;
+
+void ui_thread() {
+	panic.fire(ez::ui);
+}
+
+void audio_callback(...) {
+	if (panic.take(ez::audio)) {
+		all_notes_off();
+	}
+}
+---------------------------------------------------------------------- */
+struct alignas(cache_line_size) coalescing_event {
+	auto fire(ez::safe_t) -> void {
+		fired_.store(true, std::memory_order_release);
+	}
+	// True if the event was fired since the last call.
+	[[nodiscard]] auto take(ez::safe_t) -> bool {
+		// Cheap check first so that polling an event which hasn't been fired
+		// doesn't keep taking the cache line away from the firing thread.
+		if (!fired_.load(std::memory_order_relaxed)) { return false; }
+		return fired_.exchange(false, std::memory_order_acquire);
+	}
+private:
+	std::atomic_bool fired_ = false;
+};
+
+// Counts every fire. Any number of consumers can each keep track of how
+// many fires they have seen with an event_cursor of their own.
+struct alignas(cache_line_size) counting_event {
+	auto fire(ez::safe_t) -> void {
+		count_.fetch_add(1, std::memory_order_release);
+	}
+	// The number of times the event has been fired, in total.
+	[[nodiscard]] auto count(ez::safe_t) const -> uint64_t {
+		return count_.load(std::memory_order_acquire);
+	}
+private:
+	std::atomic<uint64_t> count_ = 0;
+};
+
+// One consumer's position in a counting_event. Reading through a cursor
+// never writes to anything shared, so consumers don't affect each other.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::counting_event note_on;
+
+struct meter {
+	ez::event_cursor cursor{note_on};
+	void process(...) {
+		for (auto n = cursor.take(ez::audio); n > 0; n--) { flash(); }
+	}
+};
+---------------------------------------------------------------------- */
+struct event_cursor {
+	// Starts from now, i.e. fires before the cursor was created aren't seen.
+	event_cursor(const counting_event& event) : event_{&event}, seen_{event.count(ez::safe)} {}
+	// The number of fires since the last call.
+	[[nodiscard]] auto take(ez::safe_t) -> uint64_t {
+		const auto count = event_->count(ez::safe);
+		return count - std::exchange(seen_, count);
+	}
+	// Like take() but only says whether there were any.
+	[[nodiscard]] auto take_any(ez::safe_t) -> bool {
+		return take(ez::safe) > 0;
+	}
+private:
+	const counting_event* event_;
+	uint64_t seen_;
+};
+
+// N coalescing events packed into the bits of as few words as possible, so
+// that a consumer can collect everything that fired since last time with
+// one atomic exchange per 64 events, and then only visit the ones that did.
+// There may only be one consumer.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::event_array<512> voice_retriggered;
+
+void ui_thread() {
+	voice_retriggered.fire(ez::ui, 37);
+}
+
+void audio_callback(...) {
+	voice_retriggered.drain(ez::audio, [](size_t voice) {
+		retrigger(voice);
+	});
+}
+---------------------------------------------------------------------- */
+template <size_t N>
+struct event_array {
+	static_assert(N > 0);
+	[[nodiscard]] static constexpr auto size() -> size_t { return N; }
+	auto fire(ez::safe_t, size_t index) -> void {
+		assert (index < N);
+		words_[index / BITS].value.fetch_or(uint64_t(1) << (index % BITS), std::memory_order_release);
+	}
+	// True if event 'index' was fired since it was last taken or drained.
+	[[nodiscard]] auto take(ez::safe_t, size_t index) -> bool {
+		assert (index < N);
+		const auto bit = uint64_t(1) << (index % BITS);
+		auto& word     = words_[index / BITS].value;
+		if (!(word.load(std::memory_order_relaxed) & bit)) { return false; }
+		return word.fetch_and(~bit, std::memory_order_acquire) & bit;
+	}
+	// Call fn(index) for every event which was fired since it was last
+	// taken or drained, in index order. Returns the number of events visited.
+	template <typename Fn>
+	auto drain(ez::safe_t, Fn&& fn) -> size_t {
+		auto visited = size_t(0);
+		for (size_t w = 0; w < WORDS; w++) {
+			auto& word = words_[w].value;
+			if (!word.load(std::memory_order_relaxed)) { continue; }
+			auto bits = word.exchange(0, std::memory_order_acquire);
+			while (bits) {
+				const auto bit = std::countr_zero(bits);
+				bits &= bits - 1;
+				fn(w * BITS + size_t(bit));
+				visited++;
+			}
+		}
+		return visited;
+	}
+private:
+	static constexpr size_t BITS  = 64;
+	static constexpr size_t WORDS = (N + BITS - 1) / BITS;
+	// Each word gets a cache line so that firing events in different
+	// words from different threads doesn't cause false sharing.
+	std::array<padded<std::atomic<uint64_t>>, WORDS> words_{};
+};
+
+} // ez
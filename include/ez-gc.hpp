@@ -0,0 +1,305 @@
+#pragma once
+
+#include "ez-tags.hpp"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__)
+#	include <pthread.h>
+#	include <sched.h>
+#endif
+
+namespace ez {
+
+struct deferred_destroyer;
+struct gc_scheduler;
+
+namespace detail {
+
+// Best effort. Does nothing on platforms where we don't know how.
+inline
+auto lower_this_thread_priority() -> void {
+#if defined(__APPLE__)
+	pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0);
+#elif defined(__linux__) && defined(SCHED_IDLE)
+	sched_param param{};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+}
+
+// The part of a value which a gc_scheduler knows about.
+struct gc_client {
+	// Do whatever the scheduler is for, e.g. run a garbage collection pass.
+	// Returns true if there is still something left to do, i.e. it is worth
+	// being called again even if the client isn't marked dirty again.
+	using collect_fn = auto (*)(void* owner) -> bool;
+	gc_client(void* owner, collect_fn collect) : owner_{owner}, collect_{collect} {}
+	gc_client(const gc_client&) = delete;
+	gc_client& operator=(const gc_client&) = delete;
+	~gc_client() { detach(); }
+	// Called whenever there is something new to do, e.g. by the writer after
+	// publishing. Lock-free.
+	auto mark_dirty() -> void;
+	auto detach() -> void;
+	// Run the client's pass directly, for a client which is made up of other
+	// clients. Same return value as collect_fn.
+	auto collect() -> bool { return collect_(owner_); }
+private:
+	void* owner_;
+	collect_fn collect_;
+	std::atomic<gc_scheduler*> scheduler_ = nullptr;
+	// Set while the client is in the scheduler's dirty list.
+	std::atomic_bool queued_ = false;
+	gc_client* next_dirty_   = nullptr;
+	// Everything below is protected by the scheduler's mutex.
+	gc_client* prev_ = nullptr;
+	gc_client* next_ = nullptr;
+	bool pending_    = false;
+	friend struct ez::gc_scheduler;
+};
+
+} // detail
+
+// Runs garbage collection for lots of values and syncs.
+// Values register with the scheduler and tell it whenever they publish
+// something, so a pass only visits the ones which have been published to
+// since they were last visited, plus any which still had versions in use by
+// a reader last time (those keep getting revisited until everything has
+// been reclaimed.) Having thousands of quiet syncs registered costs nothing.
+// Passes can be run from a thread of your own by calling collect(), or by
+// a thread belonging to the scheduler with start().
+// Example:
+/* ----------------------------------------------------------------------
+static ez::gc_scheduler gc;
+static ez::sync<Value> a;
+static ez::sync<Value> b;
+
+void init() {
+	gc.add(ez::main, a);
+	gc.add(ez::main, b);
+	gc.start(ez::main, std::chrono::milliseconds{100});
+}
+---------------------------------------------------------------------- */
+// T's destructors run on whichever thread runs the pass, so not on the
+// writer threads (unless you're also using auto_gc.)
+// Values remove themselves from the scheduler when they are destroyed. The
+// scheduler removes all of the values when it is destroyed.
+// CAUTION:
+// Don't destroy the scheduler, or remove a value from it, while something
+// is publishing to that value.
+struct gc_scheduler {
+	gc_scheduler() = default;
+	gc_scheduler(const gc_scheduler&) = delete;
+	gc_scheduler& operator=(const gc_scheduler&) = delete;
+	~gc_scheduler() {
+		stop(ez::nort);
+		auto lock = std::lock_guard{mutex_};
+		while (clients_) {
+			unlink(clients_);
+		}
+	}
+	// Works with anything that has a gc_client(), i.e. ez::value, ez::sync
+	// and everything derived from them.
+	template <typename Value>
+	auto add(ez::nort_t, Value& value) -> void {
+		add(&value.gc_client(ez::nort));
+	}
+	template <typename Value>
+	auto remove(ez::nort_t, Value& value) -> void {
+		remove(&value.gc_client(ez::nort));
+	}
+	// Run one pass. Returns the number of values visited.
+	auto collect(ez::gc_t) -> size_t {
+		auto lock = std::lock_guard{mutex_};
+		auto c    = dirty_.exchange(nullptr, std::memory_order_acquire);
+		while (c) {
+			const auto next = c->next_dirty_;
+			// Cleared before collecting so that anything published from here
+			// on puts the client back in the dirty list.
+			// The exchange pairs with the one in mark_dirty() so that we see
+			// whatever the writer did before marking the client.
+			c->queued_.exchange(false, std::memory_order_acq_rel);
+			if (!c->pending_) {
+				c->pending_ = true;
+				pending_.push_back(c);
+			}
+			c = next;
+		}
+		const auto visited = pending_.size();
+		// pending_ has room for every client so this never allocates.
+		auto kept = size_t(0);
+		for (const auto client : pending_) {
+			if (client->collect_(client->owner_)) { pending_[kept++] = client; }
+			else                                  { client->pending_ = false; }
+		}
+		pending_.resize(kept);
+		return visited;
+	}
+	// Start a thread which runs a pass every 'period'. Does nothing if the
+	// thread is already running.
+	auto start(ez::nort_t, std::chrono::nanoseconds period) -> void {
+		start(period, false);
+	}
+	// Stop the thread started by start(), if there is one, and wait for it
+	// to finish.
+	auto stop(ez::nort_t) -> void {
+		{
+			auto lock = std::lock_guard{thread_mutex_};
+			if (!thread_.joinable()) { return; }
+			stop_ = true;
+		}
+		cv_.notify_one();
+		thread_.join();
+	}
+private:
+	auto start(std::chrono::nanoseconds period, bool low_priority) -> void {
+		auto lock = std::lock_guard{thread_mutex_};
+		if (thread_.joinable()) { return; }
+		stop_ = false;
+		thread_ = std::thread{[this, period, low_priority] {
+			if (low_priority) { detail::lower_this_thread_priority(); }
+			auto lock = std::unique_lock{thread_mutex_};
+			while (!cv_.wait_for(lock, period, [this] { return stop_; })) {
+				lock.unlock();
+				collect(ez::gc);
+				lock.lock();
+			}
+		}};
+	}
+	auto add(detail::gc_client* c) -> void {
+		auto lock = std::lock_guard{mutex_};
+		auto expected = static_cast<gc_scheduler*>(nullptr);
+		if (!c->scheduler_.compare_exchange_strong(expected, this, std::memory_order_release, std::memory_order_relaxed)) {
+			assert (expected == this && "That value already belongs to another gc_scheduler!");
+			return;
+		}
+		c->next_ = clients_;
+		c->prev_ = nullptr;
+		if (clients_) { clients_->prev_ = c; }
+		clients_ = c;
+		pending_.reserve(++count_);
+		// It might already have something to collect.
+		if (!c->pending_) {
+			c->pending_ = true;
+			pending_.push_back(c);
+		}
+	}
+	auto remove(detail::gc_client* c) -> void {
+		auto lock = std::lock_guard{mutex_};
+		if (c->scheduler_.load(std::memory_order_relaxed) != this) { return; }
+		unlink(c);
+	}
+	auto unlink(detail::gc_client* c) -> void {
+		if (c->prev_) { c->prev_->next_ = c->next_; }
+		else          { clients_ = c->next_; }
+		if (c->next_) { c->next_->prev_ = c->prev_; }
+		c->prev_ = c->next_ = nullptr;
+		count_--;
+		if (c->pending_) {
+			std::erase(pending_, c);
+			c->pending_ = false;
+		}
+		c->scheduler_.store(nullptr, std::memory_order_relaxed);
+		if (c->queued_.load(std::memory_order_acquire)) {
+			// Rebuild the dirty list without it. Writers might still be
+			// pushing other clients in the meantime, which is fine.
+			auto rest = dirty_.exchange(nullptr, std::memory_order_acquire);
+			while (rest) {
+				const auto next = rest->next_dirty_;
+				if (rest != c) { push_dirty(rest); }
+				rest = next;
+			}
+			c->queued_.store(false, std::memory_order_relaxed);
+		}
+	}
+	auto push_dirty(detail::gc_client* c) -> void {
+		auto head = dirty_.load(std::memory_order_relaxed);
+		do { c->next_dirty_ = head; }
+		while (!dirty_.compare_exchange_weak(head, c, std::memory_order_release, std::memory_order_relaxed));
+	}
+	// Lock-free stack of clients which have published since they were last
+	// visited.
+	std::atomic<detail::gc_client*> dirty_ = nullptr;
+	// Protects everything below, and is held for the duration of each pass.
+	std::mutex mutex_;
+	detail::gc_client* clients_ = nullptr;
+	size_t count_               = 0;
+	std::vector<detail::gc_client*> pending_;
+	std::mutex thread_mutex_;
+	std::condition_variable cv_;
+	std::thread thread_;
+	bool stop_ = false;
+	friend struct detail::gc_client;
+	friend struct deferred_destroyer;
+};
+
+// Destroys the old versions of values which use the ez::deferred_destruction
+// policy. Their garbage collector hands the versions over instead of
+// destroying them itself, and they are destroyed here instead, so an
+// expensive destructor never holds up a writer (with auto_gc) or a
+// gc_scheduler pass.
+// Either call destroy() from a thread of your own or call start() to have
+// a thread of the destroyer's own do it. That thread runs at the lowest
+// priority we know how to ask for (SCHED_IDLE on Linux, the background QoS
+// class on macOS. Elsewhere it runs at normal priority.)
+// Like a gc_scheduler, this only visits values which have something to
+// destroy, and values remove themselves when they are destroyed.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::deferred_destroyer destroyer;
+static ez::sync<HugeSampleBuffers, true, ez::deferred_destruction> samples;
+
+void init() {
+	destroyer.add(ez::main, samples);
+	destroyer.start(ez::main, std::chrono::milliseconds{500});
+}
+---------------------------------------------------------------------- */
+struct deferred_destroyer {
+	template <typename Value>
+	auto add(ez::nort_t, Value& value) -> void {
+		scheduler_.add(&value.destroyer_client(ez::nort));
+	}
+	template <typename Value>
+	auto remove(ez::nort_t, Value& value) -> void {
+		scheduler_.remove(&value.destroyer_client(ez::nort));
+	}
+	// Destroy everything that's waiting. Returns the number of values
+	// visited.
+	auto destroy(ez::nort_t) -> size_t {
+		return scheduler_.collect(ez::gc);
+	}
+	auto start(ez::nort_t, std::chrono::nanoseconds period) -> void {
+		scheduler_.start(period, true);
+	}
+	auto stop(ez::nort_t) -> void {
+		scheduler_.stop(ez::nort);
+	}
+private:
+	gc_scheduler scheduler_;
+};
+
+namespace detail {
+
+inline
+auto gc_client::mark_dirty() -> void {
+	const auto scheduler = scheduler_.load(std::memory_order_acquire);
+	if (!scheduler) { return; }
+	if (queued_.exchange(true, std::memory_order_acq_rel)) { return; }
+	scheduler->push_dirty(this);
+}
+
+inline
+auto gc_client::detach() -> void {
+	if (const auto scheduler = scheduler_.load(std::memory_order_acquire)) {
+		scheduler->remove(this);
+	}
+}
+
+} // detail
+
+} // ez
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "ez.hpp"
+#include <optional>
+#include <tuple>
+
+namespace ez {
+
+// A consistent set of published versions of every sync in a sync_group,
+// held by whatever each sync's realtime reads return.
+template <typename... Refs>
+struct group_snapshot {
+	template <size_t I> [[nodiscard]]
+	auto get() const -> const auto& { return *std::get<I>(refs); }
+	std::tuple<Refs...> refs;
+};
+
+// Publishes changes to several syncs at once.
+// Readers who read through the group see either all of the changes made in
+// a transaction or none of them, never a torn combination. Each committed
+// transaction publishes only the syncs which were touched, so splitting
+// state up into several small syncs means a commit only copies the parts
+// which changed.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::sync<Tracks> tracks;
+static ez::sync<Routing> routing;
+static ez::sync_group group{tracks, routing};
+
+void ui_thread() {
+	auto tx = group.begin(ez::ui);
+	tx.update(tracks, [](Tracks&& x) { ...; return x; });
+	tx.set(routing, new_routing);
+	// Neither change is visible to readers of the group until this point.
+	tx.commit(ez::ui);
+}
+
+void audio_thread() {
+	auto snap = group.read(ez::audio);
+	const Tracks& t  = snap->get<0>();
+	const Routing& r = snap->get<1>();
+}
+---------------------------------------------------------------------- */
+// The syncs are still usable on their own, and their own readers will see
+// the changes from a transaction as soon as each one is published (i.e.
+// one at a time.) The syncs can't use the hazard reclamation policy
+// because the group holds on to their versions.
+// Old snapshots of the group keep references to versions of the syncs, so
+// collecting a sync on its own reclaims nothing the group is still holding.
+// Collect the group instead, with gc() or by registering the group itself
+// with a gc_scheduler. Either collects the group's snapshots first and then
+// each of the syncs.
+// A transaction keeps the group locked until it is committed. Changes are
+// staged in the transaction itself and only written to the syncs by
+// commit(), so if a transaction is destroyed without being committed then
+// the syncs are left exactly as they were.
+template <typename... Syncs>
+struct sync_group {
+	static_assert(sizeof...(Syncs) > 0);
+	static_assert((!std::is_same_v<typename Syncs::ref_type, pinned<typename Syncs::value_type>> && ...), "sync_group doesn't work with the hazard reclamation policy.");
+	using snapshot = group_snapshot<typename Syncs::ref_type...>;
+	using staged_values = std::tuple<std::optional<typename Syncs::value_type>...>;
+	struct transaction {
+		template <typename Sync>
+		auto set(Sync& sync, typename Sync::value_type value) -> void {
+			stage(sync, [&value](auto& staged) { staged = std::move(value); });
+		}
+		// fn is passed the value staged by this transaction so far, or a copy
+		// of the sync's working value if nothing has been staged yet.
+		template <typename Sync, typename Fn>
+		auto update(Sync& sync, Fn fn) -> typename Sync::value_type {
+			auto value = typename Sync::value_type{};
+			stage(sync, [&](auto& staged) {
+				staged = fn(staged ? std::move(*staged) : sync.read(ez::nort));
+				value  = *staged;
+			});
+			return value;
+		}
+		auto commit(ez::nort_t) -> void {
+			assert (lock_.owns_lock() && "Transaction was already committed!");
+			group_->commit(&staged_);
+			lock_.unlock();
+		}
+	private:
+		transaction(sync_group* group) : group_{group}, lock_{group->mutex_} {}
+		// Call fn with the staged value belonging to 'sync'.
+		template <typename Sync, typename Fn>
+		auto stage(const Sync& sync, Fn&& fn) -> void {
+			const auto found = [&]<size_t... I>(std::index_sequence<I...>) {
+				return ([&] {
+					if constexpr (std::is_same_v<std::tuple_element_t<I, std::tuple<Syncs...>>, Sync>) {
+						if (&std::get<I>(group_->syncs_) == &sync) {
+							fn(std::get<I>(staged_));
+							return true;
+						}
+					}
+					return false;
+				}() || ...);
+			}(std::index_sequence_for<Syncs...>{});
+			assert (found && "That sync isn't in this group!");
+			static_cast<void>(found);
+		}
+		sync_group* group_;
+		std::unique_lock<detail::checked_mutex> lock_;
+		staged_values staged_;
+		friend struct sync_group;
+	};
+	sync_group(Syncs&... syncs) : syncs_{syncs...} {
+		snapshot_.set(ez::nort, make_snapshot());
+	}
+	[[nodiscard]] auto begin(ez::nort_t) -> transaction                   { return transaction{this}; }
+	[[nodiscard]] auto read(detail::published_t) const -> immutable<snapshot> { return snapshot_.read(ez::safe); }
+	auto gc(ez::gc_t) -> void {
+		static_cast<void>(collect());
+	}
+	// Not for public use. See gc_scheduler.
+	[[nodiscard]] auto gc_client(ez::nort_t) -> detail::gc_client& { return scheduler_client_; }
+protected:
+	auto commit(staged_values* staged) -> void {
+		publish_staged(staged, std::index_sequence_for<Syncs...>{});
+		// This is the single atomic flip which makes the whole transaction
+		// visible to readers of the group.
+		snapshot_.set(ez::nort, make_snapshot());
+		scheduler_client_.mark_dirty();
+	}
+private:
+	// Only the syncs which were touched are published.
+	template <size_t... I>
+	auto publish_staged(staged_values* staged, std::index_sequence<I...>) -> void {
+		((std::get<I>(*staged) ? std::get<I>(syncs_).set_publish(ez::nort, std::move(*std::get<I>(*staged))) : void()), ...);
+	}
+	// The group goes first because old snapshots are holding references
+	// to versions of the syncs. Returns true if anything is left over.
+	auto collect() -> bool {
+		auto remaining = snapshot_.gc_client(ez::nort).collect();
+		std::apply([&remaining](auto&... sync) { ((remaining |= sync.gc_client(ez::nort).collect()), ...); }, syncs_);
+		return remaining;
+	}
+	auto make_snapshot() const -> snapshot {
+		return std::apply([](auto&... sync) { return snapshot{{sync.read(ez::safe)...}}; }, syncs_);
+	}
+	std::tuple<Syncs&...> syncs_;
+	detail::checked_mutex mutex_;
+	ez::value<snapshot> snapshot_;
+	// Last, so that it is detached before anything a pass could touch is
+	// destroyed.
+	detail::gc_client scheduler_client_{this, [](void* self) { return static_cast<sync_group*>(self)->collect(); }};
+};
+
+// Holds the most recently fetched snapshot of a sync_group, in the same way
+// that signalled_sync does for a single sync. The snapshot is only fetched
+// when the associated sync_signal is incremented, so every read within one
+// audio block sees the same versions of every sync in the group.
+// CAUTION:
+// Like signalled_sync, this assumes there is exactly one simultaneous
+// realtime reader.
+template <typename... Syncs>
+struct signalled_sync_group : sync_group<Syncs...> {
+	using base     = sync_group<Syncs...>;
+	using snapshot = typename base::snapshot;
+	struct transaction : base::transaction {
+		auto commit(ez::nort_t) -> void {
+			base::transaction::commit(ez::nort);
+			group_->unread_.store(true, std::memory_order_release);
+		}
+	private:
+		transaction(signalled_sync_group* group, typename base::transaction tx)
+			: base::transaction{std::move(tx)}, group_{group} {}
+		signalled_sync_group* group_;
+		friend struct signalled_sync_group;
+	};
+	using base::read;
+	signalled_sync_group(const sync_signal& signal, Syncs&... syncs) : base{syncs...}, signal_{&signal} {}
+	[[nodiscard]] auto begin(ez::nort_t) -> transaction { return transaction{this, base::begin(ez::nort)}; }
+	auto read(ez::rt_t) -> const snapshot& {
+		if (unread_.load(std::memory_order_acquire)) {
+			auto signal_value = signal_->get(ez::rt);
+			if (signal_value > local_signal_value_) {
+				local_signal_value_ = signal_value;
+				signalled_value_    = base::read(ez::rt);
+				unread_.store(false, std::memory_order_release);
+			}
+		}
+		return *signalled_value_;
+	}
+	[[nodiscard]]
+	auto is_unread(ez::safe_t) const -> bool {
+		return unread_.load(std::memory_order_acquire);
+	}
+private:
+	const sync_signal* signal_;
+	uint64_t local_signal_value_ = 0;
+	immutable<snapshot> signalled_value_;
+	std::atomic_bool unread_ = true;
+};
+
+} // ez
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "ez-cpu.hpp"
+#include "ez-tags.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace ez {
+
+// Hazard pointers.
+// A reader announces the address of the thing it is about to read by storing
+// it in one of its own hazard slots. A garbage collector scanning for
+// unreferenced memory treats anything announced in a hazard slot as alive.
+// The point of this is that a reader only ever writes to memory belonging to
+// its own thread, so readers don't fight over a shared cache line the way
+// they do with a reference count.
+// Each thread is lazily assigned a hazard record the first time it reads
+// through a hazard pointer, and the record is released when the thread exits,
+// or if something is still holding one of its slots then (e.g. a pinned
+// which outlives the thread that read it) when the last of those is gone.
+// If you don't want the (one-off, non-allocating) cost of claiming a record
+// to land in your audio callback then call ez::hazard_register(ez::nort) from
+// the thread before it starts doing realtime work.
+// CAUTION:
+// The hazard records are one static table per module, so if a value is
+// shared across a dll boundary then its readers and garbage collector must
+// all be running code from the same module.
+
+static constexpr size_t hazard_max_threads      = 128;
+static constexpr size_t hazard_slots_per_thread = 16;
+
+namespace detail {
+
+struct alignas(cache_line_size) hazard_record {
+	// Set while the owning thread is still alive.
+	static constexpr uint32_t OWNER = uint32_t(1) << 31;
+	std::atomic_bool in_use;
+	// Bitmask of slots currently owned by a hazard_slot, plus OWNER. Whoever
+	// clears the last bit gives the record back.
+	std::atomic<uint32_t> used;
+	std::array<std::atomic<const void*>, hazard_slots_per_thread> slots;
+	auto clear_bits(uint32_t bits) -> void {
+		if ((used.fetch_and(~bits, std::memory_order_acq_rel) & ~bits) == 0) {
+			in_use.store(false, std::memory_order_release);
+		}
+	}
+};
+
+static_assert(hazard_slots_per_thread <= 31);
+
+inline constinit std::array<hazard_record, hazard_max_threads> hazard_records;
+
+struct hazard_thread {
+	hazard_thread() {
+		for (auto& r : hazard_records) {
+			auto expected = false;
+			if (r.in_use.compare_exchange_strong(expected, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+				r.used.store(hazard_record::OWNER, std::memory_order_relaxed);
+				record = &r;
+				return;
+			}
+		}
+		throw std::length_error{"Too many threads are reading through ez hazard pointers!"};
+	}
+	// Slots which are still held stay announced until they are released.
+	~hazard_thread() { record->clear_bits(hazard_record::OWNER); }
+	hazard_record* record;
+};
+
+[[nodiscard]] inline
+auto this_thread_hazard_record() -> hazard_record& {
+	thread_local hazard_thread thread;
+	return *thread.record;
+}
+
+// One slot in a hazard record. Acquired by the reading thread, but can be
+// released from any thread.
+struct hazard_slot {
+	hazard_slot() = default;
+	hazard_slot(hazard_record* record) : record_{record} {
+		index_ = std::countr_one(record_->used.load(std::memory_order_relaxed));
+		if (size_t(index_) >= hazard_slots_per_thread) {
+			throw std::length_error{"Too many ez hazard pointers held by one thread!"};
+		}
+		record_->used.fetch_or(uint32_t(1) << index_, std::memory_order_relaxed);
+	}
+	hazard_slot(hazard_slot&& rhs) noexcept
+		: record_{std::exchange(rhs.record_, nullptr)}
+		, index_{rhs.index_}
+	{
+	}
+	hazard_slot& operator=(hazard_slot&& rhs) noexcept {
+		if (this != &rhs) {
+			release();
+			record_ = std::exchange(rhs.record_, nullptr);
+			index_  = rhs.index_;
+		}
+		return *this;
+	}
+	~hazard_slot() { release(); }
+	// Announce whatever src currently points to and return it. The returned
+	// pointer will not be reclaimed until this slot is cleared.
+	template <typename P> [[nodiscard]]
+	auto protect(const std::atomic<P*>& src) -> P* {
+		auto& slot = record_->slots[index_];
+		auto ptr = src.load(std::memory_order_relaxed);
+		for (;;) {
+			slot.store(ptr, std::memory_order_seq_cst);
+			const auto check = src.load(std::memory_order_seq_cst);
+			if (check == ptr) { return ptr; }
+			ptr = check;
+		}
+	}
+	// Announce a pointer which is already known to be protected by some other
+	// hazard slot.
+	auto announce(const void* ptr) -> void {
+		record_->slots[index_].store(ptr, std::memory_order_seq_cst);
+	}
+	[[nodiscard]] auto is_held() const -> bool { return record_; }
+private:
+	auto release() -> void {
+		if (!record_) { return; }
+		record_->slots[index_].store(nullptr, std::memory_order_release);
+		record_->clear_bits(uint32_t(1) << index_);
+		record_ = nullptr;
+	}
+	hazard_record* record_ = nullptr;
+	int index_             = 0;
+};
+
+// Collect the set of currently announced pointers, sorted, so that
+// is_hazard() can be used on the result.
+// The caller must have already made the memory it is about to reclaim
+// unreachable for new readers.
+template <typename Vector>
+auto collect_hazards(Vector* out) -> const Vector& {
+	out->clear();
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	for (const auto& r : hazard_records) {
+		if (!r.in_use.load(std::memory_order_acquire)) { continue; }
+		for (const auto& slot : r.slots) {
+			if (auto ptr = slot.load(std::memory_order_acquire)) {
+				out->push_back(ptr);
+			}
+		}
+	}
+	std::sort(out->begin(), out->end());
+	return *out;
+}
+
+template <typename Vector> [[nodiscard]]
+auto is_hazard(const Vector& hazards, const void* ptr) -> bool {
+	return std::binary_search(hazards.begin(), hazards.end(), ptr);
+}
+
+} // detail
+
+// Claim a hazard record for the calling thread ahead of time.
+inline
+auto hazard_register(ez::nort_t) -> void {
+	static_cast<void>(detail::this_thread_hazard_record());
+}
+
+} // ez
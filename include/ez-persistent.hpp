@@ -0,0 +1,532 @@
+#pragma once
+
+#include "ez-tags.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+namespace ez {
+
+// Persistent containers for use as (parts of) the T in an ez::value or
+// ez::sync.
+// Copying one of these is O(1) because copies share their nodes. Changing a
+// copy only copies the nodes on the path to the element being changed, so
+// if a sync's working value is one of these (or a struct of them) then a
+// publish copies almost nothing.
+// When the garbage collector reclaims an old version, the nodes which were
+// only used by that version go back to a free list and are reused by
+// later changes.
+// Reading from a const container is realtime-safe and never touches the
+// reference counts. Copying, changing or destroying a container is not
+// realtime-safe. In the intended usage that only happens on the writer and
+// garbage collector threads anyway.
+// Different copies can be used on different threads at the same time, but
+// a single container is not safe to change from one thread while another
+// thread is using it.
+
+namespace detail {
+
+// Free list of recycled persistent container nodes of one size, shared by
+// every container in the process and protected by a mutex.
+// Only used by non-realtime threads. With EZ_DEBUG_CHECKS, using it from a
+// realtime thread is reported as a violation.
+// CAUTION:
+// The pool is never trimmed. Memory for nodes which have been freed stays
+// on the free list until the program exits, so the footprint is whatever
+// the peak number of live nodes of each size was.
+template <size_t Size, size_t Align>
+struct node_pool {
+	[[nodiscard]] static
+	auto get() -> node_pool& {
+		// Deliberately never destroyed so that it outlives any static
+		// containers which are still holding nodes when the program exits.
+		static auto pool = new node_pool;
+		return *pool;
+	}
+	[[nodiscard]]
+	auto allocate() -> void* {
+		check_not_rt("Persistent container node allocated on a realtime thread.");
+		auto lock = std::lock_guard{mutex_};
+		if (free_) {
+			return std::exchange(free_, free_->next);
+		}
+		return ::operator new(std::max(Size, sizeof(free_node)), std::align_val_t{std::max(Align, alignof(free_node))});
+	}
+	auto deallocate(void* ptr) -> void {
+		check_not_rt("Persistent container node freed on a realtime thread.");
+		auto lock = std::lock_guard{mutex_};
+		free_ = ::new (ptr) free_node{free_};
+	}
+private:
+	struct free_node { free_node* next; };
+	std::mutex mutex_;
+	free_node* free_ = nullptr;
+};
+
+template <typename Node, typename... Args> [[nodiscard]]
+auto make_node(Args&&... args) -> Node* {
+	auto ptr = node_pool<sizeof(Node), alignof(Node)>::get().allocate();
+	return ::new (ptr) Node{std::forward<Args>(args)...};
+}
+
+template <typename Node>
+auto free_node(Node* node) -> void {
+	node->~Node();
+	node_pool<sizeof(Node), alignof(Node)>::get().deallocate(node);
+}
+
+struct persistent_node {
+	std::atomic<uint32_t> refs = 1;
+	bool is_leaf               = false;
+	auto retain() -> void { refs.fetch_add(1, std::memory_order_relaxed); }
+	// Returns true if this was the last reference.
+	[[nodiscard]] auto drop() -> bool { return refs.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+	// If nobody else has a reference then it's safe to change the node in
+	// place.
+	[[nodiscard]] auto is_unique() const -> bool { return refs.load(std::memory_order_acquire) == 1; }
+};
+
+static constexpr unsigned persistent_bits  = 5;
+static constexpr size_t   persistent_width = size_t(1) << persistent_bits;
+static constexpr size_t   persistent_mask  = persistent_width - 1;
+
+// Inline storage for up to persistent_width Ts, of which the first 'count'
+// are alive.
+template <typename T, size_t N = persistent_width>
+struct persistent_chunk {
+	persistent_chunk() = default;
+	persistent_chunk(const persistent_chunk& rhs) {
+		for (; count < rhs.count; count++) { std::construct_at(data() + count, rhs.data()[count]); }
+	}
+	persistent_chunk& operator=(const persistent_chunk&) = delete;
+	~persistent_chunk() { std::destroy_n(data(), count); }
+	template <typename... Args>
+	auto emplace_back(Args&&... args) -> T& { assert (count < N); return *std::construct_at(data() + count++, std::forward<Args>(args)...); }
+	auto pop_back() -> void                 { assert (count > 0); std::destroy_at(data() + --count); }
+	auto erase(size_t index) -> void {
+		assert (index < count);
+		for (auto i = index; i + 1 < count; i++) { data()[i] = std::move(data()[i + 1]); }
+		pop_back();
+	}
+	[[nodiscard]] auto data() -> T*             { return std::launder(reinterpret_cast<T*>(&storage)); }
+	[[nodiscard]] auto data() const -> const T* { return std::launder(reinterpret_cast<const T*>(&storage)); }
+	uint32_t count = 0;
+	alignas(T) std::byte storage[sizeof(T) * N];
+};
+
+} // detail
+
+// Persistent vector. Implemented as a bit-partitioned trie with 32 way
+// branching, so indexing is O(log32 n) and the leaves are contiguous
+// chunks of 32 elements.
+template <typename T>
+struct persistent_vector {
+	using value_type = T;
+	using size_type  = size_t;
+	struct const_iterator;
+	persistent_vector() = default;
+	persistent_vector(std::initializer_list<T> init) { for (const auto& x : init) { push_back(x); } }
+	persistent_vector(const persistent_vector& rhs) : root_{rhs.root_}, shift_{rhs.shift_}, size_{rhs.size_} { if (root_) { root_->retain(); } }
+	persistent_vector(persistent_vector&& rhs) noexcept
+		: root_{std::exchange(rhs.root_, nullptr)}
+		, shift_{std::exchange(rhs.shift_, 0)}
+		, size_{std::exchange(rhs.size_, 0)}
+	{
+	}
+	persistent_vector& operator=(persistent_vector rhs) noexcept {
+		std::swap(root_, rhs.root_);
+		std::swap(shift_, rhs.shift_);
+		std::swap(size_, rhs.size_);
+		return *this;
+	}
+	~persistent_vector() { release(root_); }
+	[[nodiscard]] auto size() const -> size_t  { return size_; }
+	[[nodiscard]] auto empty() const -> bool   { return size_ == 0; }
+	[[nodiscard]] auto front() const -> const T& { return (*this)[0]; }
+	[[nodiscard]] auto back() const -> const T&  { return (*this)[size_ - 1]; }
+	[[nodiscard]] auto operator[](size_t index) const -> const T& {
+		assert (index < size_);
+		return find_leaf(index)->items.data()[index & detail::persistent_mask];
+	}
+	[[nodiscard]] auto at(size_t index) const -> const T& {
+		if (index >= size_) { throw std::out_of_range{"ez::persistent_vector::at"}; }
+		return (*this)[index];
+	}
+	[[nodiscard]] auto begin() const -> const_iterator { return {this, 0}; }
+	[[nodiscard]] auto end() const -> const_iterator   { return {this, size_}; }
+	auto clear() -> void {
+		release(std::exchange(root_, nullptr));
+		shift_ = 0;
+		size_  = 0;
+	}
+	auto push_back(T value) -> void {
+		if (!root_) {
+			root_ = detail::make_node<leaf>();
+		}
+		else if (size_ == (size_t(1) << (shift_ + detail::persistent_bits))) {
+			// Full. Grow a new level on top.
+			auto new_root = detail::make_node<branch>();
+			new_root->children[0] = root_;
+			root_   = new_root;
+			shift_ += detail::persistent_bits;
+		}
+		unique_leaf(&root_, shift_, size_)->items.emplace_back(std::move(value));
+		size_++;
+	}
+	auto pop_back() -> void {
+		assert (size_ > 0);
+		pop(&root_, shift_, size_ - 1);
+		size_--;
+		// Drop levels which are no longer needed.
+		while (shift_ > 0 && size_ <= (size_t(1) << shift_)) {
+			auto old_root = static_cast<branch*>(root_);
+			root_ = old_root->children[0];
+			root_->retain();
+			release(old_root);
+			shift_ -= detail::persistent_bits;
+		}
+		if (size_ == 0) { clear(); }
+	}
+	auto set(size_t index, T value) -> void {
+		assert (index < size_);
+		unique_leaf(&root_, shift_, index)->items.data()[index & detail::persistent_mask] = std::move(value);
+	}
+	// Apply fn to the element in place, copying only the path to it.
+	template <typename Fn>
+	auto update(size_t index, Fn&& fn) -> void {
+		assert (index < size_);
+		fn(unique_leaf(&root_, shift_, index)->items.data()[index & detail::persistent_mask]);
+	}
+	struct const_iterator {
+		using iterator_category = std::forward_iterator_tag;
+		using difference_type   = std::ptrdiff_t;
+		using value_type        = T;
+		using pointer           = const T*;
+		using reference         = const T&;
+		const_iterator() = default;
+		const_iterator(const persistent_vector* v, size_t index) : v_{v}, index_{index} { fetch(); }
+		auto operator*() const -> const T&  { return chunk_[index_ & detail::persistent_mask]; }
+		auto operator->() const -> const T* { return &**this; }
+		auto operator++() -> const_iterator& { if ((++index_ & detail::persistent_mask) == 0) { fetch(); } return *this; }
+		auto operator++(int) -> const_iterator { auto tmp = *this; ++*this; return tmp; }
+		friend auto operator==(const const_iterator& a, const const_iterator& b) -> bool { return a.index_ == b.index_; }
+	private:
+		auto fetch() -> void { chunk_ = index_ < v_->size_ ? v_->find_leaf(index_)->items.data() : nullptr; }
+		const persistent_vector* v_ = nullptr;
+		size_t index_               = 0;
+		const T* chunk_             = nullptr;
+	};
+private:
+	struct branch : detail::persistent_node {
+		branch() = default;
+		branch(const branch& rhs) : detail::persistent_node{}, children{rhs.children} {}
+		std::array<detail::persistent_node*, detail::persistent_width> children = {};
+	};
+	struct leaf : detail::persistent_node {
+		leaf() { is_leaf = true; }
+		leaf(const leaf& rhs) : detail::persistent_node{}, items{rhs.items} { is_leaf = true; }
+		detail::persistent_chunk<T> items;
+	};
+	[[nodiscard]]
+	auto find_leaf(size_t index) const -> const leaf* {
+		auto node = root_;
+		for (auto shift = shift_; shift > 0; shift -= detail::persistent_bits) {
+			node = static_cast<const branch*>(node)->children[(index >> shift) & detail::persistent_mask];
+		}
+		return static_cast<const leaf*>(node);
+	}
+	// Make sure *node is not shared with any other container, copying it
+	// if necessary.
+	template <typename Node>
+	static auto make_unique(detail::persistent_node** node) -> Node* {
+		if (!*node) {
+			*node = detail::make_node<Node>();
+		}
+		else if (!(*node)->is_unique()) {
+			auto copy = detail::make_node<Node>(*static_cast<Node*>(*node));
+			if constexpr (std::is_same_v<Node, branch>) {
+				for (auto child : copy->children) { if (child) { child->retain(); } }
+			}
+			release(std::exchange(*node, copy));
+		}
+		return static_cast<Node*>(*node);
+	}
+	static auto unique_leaf(detail::persistent_node** node, unsigned shift, size_t index) -> leaf* {
+		for (; shift > 0; shift -= detail::persistent_bits) {
+			node = &make_unique<branch>(node)->children[(index >> shift) & detail::persistent_mask];
+		}
+		return make_unique<leaf>(node);
+	}
+	static auto pop(detail::persistent_node** node, unsigned shift, size_t index) -> void {
+		if (shift == 0) {
+			auto l = make_unique<leaf>(node);
+			l->items.pop_back();
+			if (l->items.count == 0) { release(std::exchange(*node, nullptr)); }
+			return;
+		}
+		const auto i = (index >> shift) & detail::persistent_mask;
+		auto b = make_unique<branch>(node);
+		pop(&b->children[i], shift - detail::persistent_bits, index);
+		// Children are always filled from the left, so if the first one
+		// has gone then so has everything else.
+		if (i == 0 && !b->children[0]) { release(std::exchange(*node, nullptr)); }
+	}
+	static auto release(detail::persistent_node* node) -> void {
+		if (!node || !node->drop()) { return; }
+		if (node->is_leaf) {
+			detail::free_node(static_cast<leaf*>(node));
+			return;
+		}
+		auto b = static_cast<branch*>(node);
+		for (auto child : b->children) { release(child); }
+		detail::free_node(b);
+	}
+	detail::persistent_node* root_ = nullptr;
+	unsigned shift_                = 0;
+	size_t size_                   = 0;
+};
+
+// Persistent hash map. Implemented as a hash trie with 32 way branching.
+// Keys are bucketed into small contiguous chunks which are split into
+// another level when they fill up.
+template <typename K, typename V, typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
+struct persistent_map {
+	using key_type   = K;
+	using value_type = std::pair<K, V>;
+private:
+	static constexpr uint32_t BUCKET_SIZE = 8;
+	static constexpr unsigned HASH_BITS   = sizeof(size_t) * 8;
+	static constexpr size_t MAX_DEPTH     = (HASH_BITS + detail::persistent_bits - 1) / detail::persistent_bits + 1;
+	struct branch : detail::persistent_node {
+		branch() = default;
+		branch(const branch& rhs) : detail::persistent_node{}, children{rhs.children} {}
+		std::array<detail::persistent_node*, detail::persistent_width> children = {};
+	};
+	// A bucket only overflows into another one if it is at the bottom of
+	// the trie, i.e. every bit of the hashes in it was the same.
+	struct bucket : detail::persistent_node {
+		bucket() { is_leaf = true; }
+		bucket(const bucket& rhs) : detail::persistent_node{}, hashes{rhs.hashes}, entries{rhs.entries}, overflow{rhs.overflow} {
+			is_leaf = true;
+			if (overflow) { overflow->retain(); }
+		}
+		std::array<size_t, BUCKET_SIZE> hashes = {};
+		detail::persistent_chunk<value_type, BUCKET_SIZE> entries;
+		detail::persistent_node* overflow = nullptr;
+	};
+public:
+	struct const_iterator;
+	persistent_map() = default;
+	persistent_map(std::initializer_list<value_type> init) { for (const auto& [k, v] : init) { insert_or_assign(k, v); } }
+	persistent_map(const persistent_map& rhs) : root_{rhs.root_}, size_{rhs.size_} { if (root_) { root_->retain(); } }
+	persistent_map(persistent_map&& rhs) noexcept
+		: root_{std::exchange(rhs.root_, nullptr)}
+		, size_{std::exchange(rhs.size_, 0)}
+	{
+	}
+	persistent_map& operator=(persistent_map rhs) noexcept {
+		std::swap(root_, rhs.root_);
+		std::swap(size_, rhs.size_);
+		return *this;
+	}
+	~persistent_map() { release(root_); }
+	[[nodiscard]] auto size() const -> size_t { return size_; }
+	[[nodiscard]] auto empty() const -> bool  { return size_ == 0; }
+	[[nodiscard]] auto contains(const K& key) const -> bool { return find(key) != nullptr; }
+	// Returns nullptr if the key isn't in the map.
+	[[nodiscard]]
+	auto find(const K& key) const -> const V* {
+		const auto hash = Hash{}(key);
+		auto node       = root_;
+		for (unsigned shift = 0; node && !node->is_leaf; shift += detail::persistent_bits) {
+			node = static_cast<const branch*>(node)->children[(hash >> shift) & detail::persistent_mask];
+		}
+		for (auto b = static_cast<const bucket*>(node); b; b = static_cast<const bucket*>(b->overflow)) {
+			for (uint32_t i = 0; i < b->entries.count; i++) {
+				if (b->hashes[i] == hash && KeyEqual{}(b->entries.data()[i].first, key)) {
+					return &b->entries.data()[i].second;
+				}
+			}
+		}
+		return nullptr;
+	}
+	[[nodiscard]] auto at(const K& key) const -> const V& {
+		if (auto v = find(key)) { return *v; }
+		throw std::out_of_range{"ez::persistent_map::at"};
+	}
+	[[nodiscard]] auto begin() const -> const_iterator { return const_iterator{root_}; }
+	[[nodiscard]] auto end() const -> const_iterator   { return const_iterator{}; }
+	auto clear() -> void {
+		release(std::exchange(root_, nullptr));
+		size_ = 0;
+	}
+	// Returns true if the key was inserted, false if it was assigned.
+	auto insert_or_assign(K key, V value) -> bool {
+		const auto hash = Hash{}(key);
+		auto node       = &root_;
+		auto shift      = 0u;
+		for (;;) {
+			if (*node && !(*node)->is_leaf) {
+				node   = &make_unique<branch>(node)->children[(hash >> shift) & detail::persistent_mask];
+				shift += detail::persistent_bits;
+				continue;
+			}
+			auto b = make_unique<bucket>(node);
+			for (uint32_t i = 0; i < b->entries.count; i++) {
+				if (b->hashes[i] == hash && KeyEqual{}(b->entries.data()[i].first, key)) {
+					b->entries.data()[i].second = std::move(value);
+					return false;
+				}
+			}
+			if (b->overflow) {
+				node = &b->overflow;
+				continue;
+			}
+			if (b->entries.count < BUCKET_SIZE) {
+				b->hashes[b->entries.count] = hash;
+				b->entries.emplace_back(std::move(key), std::move(value));
+				size_++;
+				return true;
+			}
+			if (shift >= HASH_BITS) {
+				// Out of hash bits. Chain another bucket on the end.
+				node = &b->overflow;
+				continue;
+			}
+			split(node, shift);
+		}
+	}
+	// Returns true if the key was found and erased.
+	auto erase(const K& key) -> bool {
+		if (!find(key)) { return false; }
+		erase(&root_, Hash{}(key), key, 0);
+		size_--;
+		return true;
+	}
+	struct const_iterator {
+		using iterator_category = std::forward_iterator_tag;
+		using difference_type   = std::ptrdiff_t;
+		using value_type        = persistent_map::value_type;
+		using pointer           = const value_type*;
+		using reference         = const value_type&;
+		const_iterator() = default;
+		explicit const_iterator(const detail::persistent_node* root) {
+			if (root) { stack_[0] = {root, 0}; depth_ = 1; settle(); }
+		}
+		auto operator*() const -> const value_type&  { return bucket_->entries.data()[index_]; }
+		auto operator->() const -> const value_type* { return &**this; }
+		auto operator++() -> const_iterator& {
+			if (++index_ < bucket_->entries.count) { return *this; }
+			index_ = 0;
+			if ((bucket_ = static_cast<const bucket*>(bucket_->overflow))) { return *this; }
+			settle();
+			return *this;
+		}
+		auto operator++(int) -> const_iterator { auto tmp = *this; ++*this; return tmp; }
+		friend auto operator==(const const_iterator& a, const const_iterator& b) -> bool { return a.bucket_ == b.bucket_ && a.index_ == b.index_; }
+	private:
+		struct frame { const detail::persistent_node* node; uint32_t next; };
+		// Depth first search for the next non-empty bucket.
+		auto settle() -> void {
+			bucket_ = nullptr;
+			while (depth_ > 0) {
+				auto& top = stack_[depth_ - 1];
+				if (top.node->is_leaf) {
+					auto b = static_cast<const bucket*>(top.node);
+					depth_--;
+					if (b->entries.count > 0) { bucket_ = b; return; }
+					continue;
+				}
+				auto br = static_cast<const branch*>(top.node);
+				while (top.next < detail::persistent_width && !br->children[top.next]) { top.next++; }
+				if (top.next == detail::persistent_width) { depth_--; continue; }
+				stack_[depth_++] = {br->children[top.next++], 0};
+			}
+		}
+		std::array<frame, MAX_DEPTH + 1> stack_ = {};
+		size_t depth_          = 0;
+		const bucket* bucket_  = nullptr;
+		uint32_t index_        = 0;
+	};
+private:
+	template <typename Node>
+	static auto make_unique(detail::persistent_node** node) -> Node* {
+		if (!*node) {
+			*node = detail::make_node<Node>();
+		}
+		else if (!(*node)->is_unique()) {
+			auto copy = detail::make_node<Node>(*static_cast<Node*>(*node));
+			if constexpr (std::is_same_v<Node, branch>) {
+				for (auto child : copy->children) { if (child) { child->retain(); } }
+			}
+			release(std::exchange(*node, copy));
+		}
+		return static_cast<Node*>(*node);
+	}
+	// Replace a full bucket with a branch and redistribute its entries one
+	// level further down.
+	// The bucket must already be unique.
+	static auto split(detail::persistent_node** node, unsigned shift) -> void {
+		auto b  = static_cast<bucket*>(*node);
+		auto br = detail::make_node<branch>();
+		*node   = br;
+		for (uint32_t i = 0; i < b->entries.count; i++) {
+			const auto hash = b->hashes[i];
+			auto child      = make_unique<bucket>(&br->children[(hash >> shift) & detail::persistent_mask]);
+			child->hashes[child->entries.count] = hash;
+			child->entries.emplace_back(std::move(b->entries.data()[i]));
+		}
+		release(b);
+	}
+	static auto erase(detail::persistent_node** node, size_t hash, const K& key, unsigned shift) -> void {
+		if (!(*node)->is_leaf) {
+			auto br = make_unique<branch>(node);
+			auto& child = br->children[(hash >> shift) & detail::persistent_mask];
+			erase(&child, hash, key, shift + detail::persistent_bits);
+			if (!child && std::all_of(br->children.begin(), br->children.end(), [](auto c) { return !c; })) {
+				release(std::exchange(*node, nullptr));
+			}
+			return;
+		}
+		auto b = static_cast<const bucket*>(*node);
+		for (uint32_t i = 0; i < b->entries.count; i++) {
+			if (b->hashes[i] == hash && KeyEqual{}(b->entries.data()[i].first, key)) {
+				auto mb = make_unique<bucket>(node);
+				for (auto j = i; j + 1 < mb->entries.count; j++) { mb->hashes[j] = mb->hashes[j + 1]; }
+				mb->entries.erase(i);
+				if (mb->entries.count == 0) {
+					auto overflow = std::exchange(mb->overflow, nullptr);
+					release(std::exchange(*node, overflow));
+				}
+				return;
+			}
+		}
+		erase(&make_unique<bucket>(node)->overflow, hash, key, shift);
+	}
+	static auto release(detail::persistent_node* node) -> void {
+		if (!node || !node->drop()) { return; }
+		if (node->is_leaf) {
+			auto b = static_cast<bucket*>(node);
+			release(b->overflow);
+			detail::free_node(b);
+			return;
+		}
+		auto br = static_cast<branch*>(node);
+		for (auto child : br->children) { release(child); }
+		detail::free_node(br);
+	}
+	detail::persistent_node* root_ = nullptr;
+	size_t size_                   = 0;
+};
+
+} // ez
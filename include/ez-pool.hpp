@@ -0,0 +1,237 @@
+#pragma once
+
+#include "ez-cpu.hpp"
+#include "ez-tags.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#	include <pthread.h>
+#	include <sched.h>
+#endif
+
+namespace ez {
+
+namespace detail {
+
+// Best effort. Does nothing on platforms where we don't know how.
+inline
+auto pin_this_thread([[maybe_unused]] size_t cpu) -> void {
+#if defined(__linux__)
+	const auto cpus = std::max(1u, std::thread::hardware_concurrency());
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % cpus, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// The tasks of one block which are waiting to be run by one worker, as a
+// range of task indices in a single word, so that the worker can take
+// them from the front and thieves can take them from the back without any
+// locks. The word is tagged with the block it belongs to, so that a late
+// worker which is still looking at the previous block can't take anything
+// from this one.
+struct alignas(cache_line_size) task_range {
+	static constexpr uint64_t INDEX_BITS = 24;
+	static constexpr uint64_t INDEX_MASK = (uint64_t(1) << INDEX_BITS) - 1;
+	static constexpr uint64_t TAG_MASK   = 0xFFFF;
+	static constexpr size_t   MAX_TASKS  = INDEX_MASK;
+	struct unpacked { uint64_t tag; uint64_t begin; uint64_t end; };
+	[[nodiscard]] static auto pack(uint64_t tag, uint64_t begin, uint64_t end) -> uint64_t {
+		return ((tag & TAG_MASK) << (INDEX_BITS * 2)) | (begin << INDEX_BITS) | end;
+	}
+	[[nodiscard]] static auto unpack(uint64_t word) -> unpacked {
+		return {word >> (INDEX_BITS * 2), (word >> INDEX_BITS) & INDEX_MASK, word & INDEX_MASK};
+	}
+	auto set(uint64_t tag, uint64_t begin, uint64_t end) -> void {
+		word_.store(pack(tag, begin, end), std::memory_order_release);
+	}
+	// Take the next task from the front.
+	[[nodiscard]] auto pop(uint64_t tag, size_t* task) -> bool {
+		auto word = word_.load(std::memory_order_acquire);
+		for (;;) {
+			const auto r = unpack(word);
+			if (r.tag != (tag & TAG_MASK) || r.begin >= r.end) { return false; }
+			if (word_.compare_exchange_weak(word, pack(tag, r.begin + 1, r.end), std::memory_order_acq_rel, std::memory_order_acquire)) {
+				*task = size_t(r.begin);
+				return true;
+			}
+		}
+	}
+	// Take the back half.
+	[[nodiscard]] auto steal(uint64_t tag, uint64_t* begin, uint64_t* end) -> bool {
+		auto word = word_.load(std::memory_order_acquire);
+		for (;;) {
+			const auto r = unpack(word);
+			if (r.tag != (tag & TAG_MASK) || r.begin >= r.end) { return false; }
+			const auto mid = r.end - (r.end - r.begin + 1) / 2;
+			if (word_.compare_exchange_weak(word, pack(tag, r.begin, mid), std::memory_order_acq_rel, std::memory_order_acquire)) {
+				*begin = mid;
+				*end   = r.end;
+				return true;
+			}
+		}
+	}
+private:
+	std::atomic<uint64_t> word_ = 0;
+};
+
+} // detail
+
+// A pool of worker threads for splitting the work of one audio block
+// between several cores.
+// run_block() hands out the tasks of a block evenly between the calling
+// thread and the workers, and workers which run out steal half of whatever
+// is left from somebody else. The calling thread works on the block too,
+// and steals like everybody else, so it never waits for a worker which
+// hasn't woken up yet. It only ever waits for tasks which another thread
+// has already started and not yet finished.
+// Nothing is allocated, and no locks are taken, after construction. Idle
+// workers spin for a little while after each block in case another one
+// comes along soon, and then go to sleep on an atomic wait. Waking them is
+// a notify, which is skipped if none of them are sleeping.
+// To have every worker see the same published state for the block, read
+// shared_signalled_syncs from the tasks. Increment the signal and then read
+// each of them once from the calling thread, before calling run_block(), so
+// the fetch is over before any of the workers get there.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::sync_signal signal;
+static ez::shared_signalled_sync<Tracks> tracks{signal};
+static ez::rt_pool pool{3};
+
+void audio_callback(...) {
+	signal.increment(ez::audio);
+	const auto& t = *tracks.read(ez::audio);
+	pool.run_block(ez::audio, t.size(), [&](size_t i) {
+		process_track(tracks.read(ez::audio)->at(i));
+	});
+}
+---------------------------------------------------------------------- */
+// Workers are pinned to one core each, where we know how (Linux only for
+// now.) Their priority isn't touched, so raise it from your own code if you
+// have a way of doing that which suits your platform.
+// CAUTION:
+// Only one thread at a time may call run_block(). If a worker is preempted
+// in the middle of a task then run_block() waits for it to finish that task.
+// A block can have at most 2^24 - 1 tasks.
+struct rt_pool {
+	// 'threads' workers are started in addition to the thread which calls
+	// run_block(), and pinned to cores 1 to 'threads'.
+	explicit rt_pool(size_t threads) : ranges_{std::make_unique<detail::task_range[]>(threads + 1)}, participants_{threads + 1} {
+		workers_.reserve(threads);
+		for (size_t i = 0; i < threads; i++) {
+			workers_.emplace_back([this, i] { work(i + 1); });
+		}
+	}
+	rt_pool(const rt_pool&) = delete;
+	rt_pool& operator=(const rt_pool&) = delete;
+	~rt_pool() {
+		stop_.store(true, std::memory_order_relaxed);
+		epoch_.fetch_add(1, std::memory_order_seq_cst);
+		epoch_.notify_all();
+		for (auto& t : workers_) { t.join(); }
+	}
+	// The number of threads which work on each block, including the caller.
+	[[nodiscard]] auto size(ez::safe_t) const -> size_t { return participants_; }
+	// Call fn(i) for every i in [0, count) between the calling thread and the
+	// workers, and return when they have all been called.
+	template <typename Fn>
+	auto run_block(ez::rt_t, size_t count, Fn&& fn) -> void {
+		if (count == 0) { return; }
+		assert (count <= detail::task_range::MAX_TASKS);
+		const auto block = epoch_.load(std::memory_order_relaxed) + 1;
+		for (size_t i = 0; i < participants_; i++) {
+			ranges_[i].set(block, count * i / participants_, count * (i + 1) / participants_);
+		}
+		fn_  = [](void* ctx, size_t task) { (*static_cast<std::remove_reference_t<Fn>*>(ctx))(task); };
+		ctx_ = const_cast<void*>(static_cast<const void*>(std::addressof(fn)));
+		remaining_.store(count, std::memory_order_relaxed);
+		// Either we see a sleeping worker here or it sees the new block after
+		// announcing itself, so nobody sleeps through a block.
+		epoch_.store(block, std::memory_order_seq_cst);
+		if (sleepers_.load(std::memory_order_seq_cst) > 0) {
+			epoch_.notify_all();
+		}
+		run_tasks(0, block);
+		while (remaining_.load(std::memory_order_acquire) > 0) {
+			detail::cpu_relax();
+		}
+	}
+private:
+	static constexpr int SPINS_BEFORE_SLEEPING = 4096;
+	auto work(size_t self) -> void {
+		detail::pin_this_thread(self);
+		auto seen = uint64_t(0);
+		for (;;) {
+			seen = wait_for_block(seen);
+			if (stop_.load(std::memory_order_relaxed)) { return; }
+			run_tasks(self, seen);
+		}
+	}
+	auto wait_for_block(uint64_t seen) -> uint64_t {
+		for (int i = 0; i < SPINS_BEFORE_SLEEPING; i++) {
+			const auto epoch = epoch_.load(std::memory_order_acquire);
+			if (epoch != seen) { return epoch; }
+			detail::cpu_relax();
+		}
+		sleepers_.fetch_add(1, std::memory_order_seq_cst);
+		auto epoch = epoch_.load(std::memory_order_seq_cst);
+		while (epoch == seen) {
+			epoch_.wait(seen, std::memory_order_seq_cst);
+			epoch = epoch_.load(std::memory_order_seq_cst);
+		}
+		sleepers_.fetch_sub(1, std::memory_order_relaxed);
+		return epoch;
+	}
+	auto run_tasks(size_t self, uint64_t block) -> void {
+		auto task = size_t(0);
+		for (;;) {
+			if (ranges_[self].pop(block, &task) || steal(self, block, &task)) {
+				// Having been able to take a task means the block isn't
+				// finished, so these are still the ones for this block.
+				fn_(ctx_, task);
+				remaining_.fetch_sub(1, std::memory_order_release);
+				continue;
+			}
+			return;
+		}
+	}
+	// Steal half of somebody else's tasks. Keep the first one to run now
+	// and put the rest in our own range, which is empty or we wouldn't be
+	// stealing, so nobody else is touching it.
+	auto steal(size_t self, uint64_t block, size_t* task) -> bool {
+		for (size_t i = 1; i < participants_; i++) {
+			const auto victim = (self + i) % participants_;
+			auto begin = uint64_t(0);
+			auto end   = uint64_t(0);
+			if (ranges_[victim].steal(block, &begin, &end)) {
+				*task = size_t(begin);
+				ranges_[self].set(block, begin + 1, end);
+				return true;
+			}
+		}
+		return false;
+	}
+	std::unique_ptr<detail::task_range[]> ranges_;
+	const size_t participants_;
+	// Written by run_block() before the epoch is bumped.
+	auto (*fn_)(void* ctx, size_t task) -> void = nullptr;
+	void* ctx_ = nullptr;
+	alignas(cache_line_size) std::atomic<uint64_t> epoch_ = 0;
+	std::atomic<int> sleepers_ = 0;
+	std::atomic_bool stop_     = false;
+	alignas(cache_line_size) std::atomic<size_t> remaining_ = 0;
+	std::vector<std::thread> workers_;
+};
+
+} // ez
@@ -0,0 +1,348 @@
+#pragma once
+
+#include "ez-cpu.hpp"
+#include "ez-tags.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+namespace ez {
+
+// Bounded message queues for sending stuff between realtime and
+// non-realtime threads, e.g. meter values, MIDI learn events or "the audio
+// thread has finished with X" notifications.
+// Every operation takes ez::safe because none of them block, allocate or
+// make system calls, so both ends can be either kind of thread. They are
+// not thread-safe beyond what the name says though: an spsc_queue has
+// exactly one producer and one consumer, an mpsc_queue has any number of
+// producers and exactly one consumer.
+// The queue holds N live T objects for its whole lifetime and items are
+// assigned into them, so nothing is constructed or destroyed by pushing or
+// popping. If T owns some memory then that memory hangs around in the
+// queue and gets reused. This is also what makes the zero-copy interface
+// work: reserve() hands out a T which is already sitting in the queue, you
+// fill it in, and commit() makes it visible to the consumer. On the other
+// end, peek() gives the consumer the T in the queue and consume() hands it
+// back.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::spsc_queue<meter_values, 64> meters;
+
+void audio_thread() {
+	if (auto item = meters.reserve(ez::audio)) {
+		calculate_meters(item);
+		meters.commit(ez::audio);
+	}
+}
+
+void ui_thread() {
+	while (auto item = meters.peek(ez::ui)) {
+		draw_meters(*item);
+		meters.consume(ez::ui);
+	}
+}
+---------------------------------------------------------------------- */
+// N must be a power of two.
+
+// One producer, one consumer. Everything is wait-free.
+template <typename T, size_t N>
+struct spsc_queue {
+	static_assert(std::has_single_bit(N), "Queue capacity must be a power of two.");
+	static_assert(std::is_default_constructible_v<T>);
+	[[nodiscard]] static constexpr auto capacity() -> size_t { return N; }
+	// Producer ----------------------------------------------------------
+	[[nodiscard]]
+	auto push(ez::safe_t, const T& item) -> bool {
+		auto slot = reserve(ez::safe);
+		if (!slot) { return false; }
+		*slot = item;
+		commit(ez::safe);
+		return true;
+	}
+	[[nodiscard]]
+	auto push(ez::safe_t, T&& item) -> bool {
+		auto slot = reserve(ez::safe);
+		if (!slot) { return false; }
+		*slot = std::move(item);
+		commit(ez::safe);
+		return true;
+	}
+	// Push as many of the items as will fit. Returns the number pushed.
+	[[nodiscard]]
+	auto push(ez::safe_t, std::span<const T> items) -> size_t {
+		const auto tail = tail_.load(std::memory_order_relaxed);
+		const auto n    = std::min(items.size(), free_space(tail, items.size()));
+		for (size_t i = 0; i < n; i++) {
+			buffer_[(tail + i) & MASK] = items[i];
+		}
+		tail_.store(tail + n, std::memory_order_release);
+		return n;
+	}
+	// Returns the next free item in the queue or nullptr if the queue is
+	// full. It contains whatever was last popped from that position.
+	[[nodiscard]]
+	auto reserve(ez::safe_t) -> T* {
+		const auto slots = reserve(ez::safe, 1);
+		return slots.empty() ? nullptr : slots.data();
+	}
+	// Returns up to n contiguous free items. This can be fewer than n even
+	// if there is room for n, when the free space wraps around the end of
+	// the buffer, so call it again after committing if you need more.
+	[[nodiscard]]
+	auto reserve(ez::safe_t, size_t n) -> std::span<T> {
+		const auto tail  = tail_.load(std::memory_order_relaxed);
+		const auto index = tail & MASK;
+		n = std::min({n, free_space(tail, n), N - index});
+		return {buffer_.data() + index, n};
+	}
+	// Make the first n reserved items visible to the consumer.
+	auto commit(ez::safe_t, size_t n = 1) -> void {
+		const auto tail = tail_.load(std::memory_order_relaxed);
+		assert (tail + n - cached_head_ <= N && "Committed more items than were reserved!");
+		tail_.store(tail + n, std::memory_order_release);
+	}
+	// Consumer ----------------------------------------------------------
+	[[nodiscard]]
+	auto pop(ez::safe_t, T* out) -> bool {
+		auto item = peek(ez::safe);
+		if (!item) { return false; }
+		*out = std::move(*item);
+		consume(ez::safe);
+		return true;
+	}
+	// Pop as many items as are available, up to the size of out. Returns the
+	// number popped.
+	[[nodiscard]]
+	auto pop(ez::safe_t, std::span<T> out) -> size_t {
+		const auto head = head_.load(std::memory_order_relaxed);
+		const auto n    = std::min(out.size(), available(head, out.size()));
+		for (size_t i = 0; i < n; i++) {
+			out[i] = std::move(buffer_[(head + i) & MASK]);
+		}
+		head_.store(head + n, std::memory_order_release);
+		return n;
+	}
+	// Returns the item at the front of the queue or nullptr if the queue is
+	// empty. It stays in the queue until consume() is called.
+	[[nodiscard]]
+	auto peek(ez::safe_t) -> T* {
+		const auto items = peek(ez::safe, 1);
+		return items.empty() ? nullptr : items.data();
+	}
+	// Returns up to n contiguous items from the front of the queue. Like
+	// reserve(), this can return fewer than are available when they wrap
+	// around the end of the buffer.
+	[[nodiscard]]
+	auto peek(ez::safe_t, size_t n) -> std::span<T> {
+		const auto head  = head_.load(std::memory_order_relaxed);
+		const auto index = head & MASK;
+		n = std::min({n, available(head, n), N - index});
+		return {buffer_.data() + index, n};
+	}
+	// Hand the first n peeked items back to the producer.
+	auto consume(ez::safe_t, size_t n = 1) -> void {
+		const auto head = head_.load(std::memory_order_relaxed);
+		assert (cached_tail_ - head >= n && "Consumed more items than were peeked!");
+		head_.store(head + n, std::memory_order_release);
+	}
+	// These are only exact when called by the consumer.
+	[[nodiscard]] auto empty(ez::safe_t) const -> bool { return size(ez::safe) == 0; }
+	[[nodiscard]] auto size(ez::safe_t) const -> size_t {
+		const auto head = head_.load(std::memory_order_acquire);
+		return tail_.load(std::memory_order_acquire) - head;
+	}
+private:
+	static constexpr size_t MASK = N - 1;
+	// Each end keeps a copy of the other end's index and only goes back to
+	// the shared one when the copy says there isn't enough room, so most of
+	// the time neither end touches the other's cache line.
+	auto free_space(size_t tail, size_t wanted) -> size_t {
+		if (N - (tail - cached_head_) < wanted) {
+			cached_head_ = head_.load(std::memory_order_acquire);
+		}
+		return N - (tail - cached_head_);
+	}
+	auto available(size_t head, size_t wanted) -> size_t {
+		if (cached_tail_ - head < wanted) {
+			cached_tail_ = tail_.load(std::memory_order_acquire);
+		}
+		return cached_tail_ - head;
+	}
+	alignas(cache_line_size) std::atomic<size_t> tail_ = 0;
+	alignas(cache_line_size) size_t cached_head_       = 0; // Producer only
+	alignas(cache_line_size) std::atomic<size_t> head_ = 0;
+	alignas(cache_line_size) size_t cached_tail_       = 0; // Consumer only
+	alignas(cache_line_size) std::array<T, N> buffer_;
+};
+
+// Any number of producers, one consumer. Pushing is lock-free, popping is
+// wait-free.
+// CAUTION:
+// A producer which reserves an item and doesn't commit it holds up the
+// consumer, because the items are consumed in the order they were
+// reserved. So don't go doing anything slow in between.
+template <typename T, size_t N>
+struct mpsc_queue {
+	static_assert(std::has_single_bit(N), "Queue capacity must be a power of two.");
+	static_assert(N >= 2, "An mpsc_queue needs a capacity of at least two. See the cell states below.");
+	static_assert(std::is_default_constructible_v<T>);
+	struct reservation {
+		[[nodiscard]] explicit operator bool() const { return item_; }
+		[[nodiscard]] auto operator*() const -> T&   { return *item_; }
+		[[nodiscard]] auto operator->() const -> T*  { return item_; }
+	private:
+		T* item_    = nullptr;
+		size_t pos_ = 0;
+		friend struct mpsc_queue;
+	};
+	mpsc_queue() {
+		for (size_t i = 0; i < N; i++) {
+			cells_[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+	[[nodiscard]] static constexpr auto capacity() -> size_t { return N; }
+	// Producer ----------------------------------------------------------
+	[[nodiscard]]
+	auto push(ez::safe_t, const T& item) -> bool {
+		auto r = reserve(ez::safe);
+		if (!r) { return false; }
+		*r = item;
+		commit(ez::safe, r);
+		return true;
+	}
+	[[nodiscard]]
+	auto push(ez::safe_t, T&& item) -> bool {
+		auto r = reserve(ez::safe);
+		if (!r) { return false; }
+		*r = std::move(item);
+		commit(ez::safe, r);
+		return true;
+	}
+	// Push as many of the items as will fit. They are claimed all at once, so
+	// they arrive together even if other producers are pushing at the same
+	// time. Returns the number pushed.
+	[[nodiscard]]
+	auto push(ez::safe_t, std::span<const T> items) -> size_t {
+		const auto [pos, n] = claim(std::min(items.size(), N));
+		for (size_t i = 0; i < n; i++) {
+			auto& cell = cells_[(pos + i) & MASK];
+			cell.value = items[i];
+			cell.seq.store(pos + i + 1, std::memory_order_release);
+		}
+		return n;
+	}
+	// Returns a reservation which evaluates to false if the queue is full.
+	[[nodiscard]]
+	auto reserve(ez::safe_t) -> reservation {
+		reservation r;
+		const auto [pos, n] = claim(1);
+		if (n > 0) {
+			r.item_ = &cells_[pos & MASK].value;
+			r.pos_  = pos;
+		}
+		return r;
+	}
+	auto commit(ez::safe_t, reservation r) -> void {
+		assert (r && "Tried to commit an empty reservation!");
+		cells_[r.pos_ & MASK].seq.store(r.pos_ + 1, std::memory_order_release);
+	}
+	// Consumer ----------------------------------------------------------
+	[[nodiscard]]
+	auto pop(ez::safe_t, T* out) -> bool {
+		auto item = peek(ez::safe);
+		if (!item) { return false; }
+		*out = std::move(*item);
+		consume(ez::safe);
+		return true;
+	}
+	// Pop as many items as are available, up to the size of out. Returns the
+	// number popped.
+	[[nodiscard]]
+	auto pop(ez::safe_t, std::span<T> out) -> size_t {
+		size_t n = 0;
+		while (n < out.size() && pop(ez::safe, &out[n])) { n++; }
+		return n;
+	}
+	// Returns the item at the front of the queue or nullptr if the queue is
+	// empty (or if the producer of the front item hasn't committed it yet.)
+	// It stays in the queue until consume() is called.
+	[[nodiscard]]
+	auto peek(ez::safe_t) -> T* {
+		auto& cell = cells_[head_ & MASK];
+		if (cell.seq.load(std::memory_order_acquire) != head_ + 1) { return nullptr; }
+		return &cell.value;
+	}
+	// Hand the peeked item back to the producers.
+	auto consume(ez::safe_t) -> void {
+		auto& cell = cells_[head_ & MASK];
+		assert (cell.seq.load(std::memory_order_relaxed) == head_ + 1 && "Nothing to consume!");
+		cell.seq.store(head_ + N, std::memory_order_release);
+		head_++;
+	}
+	// Only exact when called by the consumer.
+	[[nodiscard]] auto empty(ez::safe_t) -> bool { return !peek(ez::safe); }
+private:
+	static constexpr size_t MASK = N - 1;
+	// Each cell's sequence number says what state it is in, relative to a
+	// position pos which maps to it:
+	//   seq == pos       Free to be claimed by the producer of pos.
+	//   seq == pos + 1   Committed, waiting for the consumer.
+	//   seq == pos + N   Consumed, free for the producer of pos + N.
+	// With N == 1 the last two states would be the same number, and a
+	// committed cell would look free, hence N >= 2.
+	struct cell {
+		std::atomic<size_t> seq;
+		T value;
+	};
+	// Claim up to n consecutive positions. Returns the first position and how
+	// many were claimed, which is zero if the queue is full.
+	auto claim(size_t n) -> std::pair<size_t, size_t> {
+		auto pos = tail_.load(std::memory_order_relaxed);
+		while (n > 0) {
+			// The consumer frees cells in order, so if the last cell is free
+			// then so are the ones before it.
+			const auto last = pos + n - 1;
+			const auto seq  = cells_[last & MASK].seq.load(std::memory_order_acquire);
+			const auto diff = static_cast<std::intptr_t>(seq - last);
+			if (diff == 0) {
+				if (tail_.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+					return {pos, n};
+				}
+			}
+			else if (diff < 0) {
+				// Not enough room. Try again for exactly as many as there is
+				// room for.
+				n = room(pos, n - 1);
+			}
+			else {
+				pos = tail_.load(std::memory_order_relaxed);
+			}
+		}
+		return {pos, 0};
+	}
+	// How many of the n cells from pos are free, given that the one after
+	// them isn't. The consumer frees cells in order, so the ones which
+	// aren't free yet are all at the end and can be found by bisection.
+	auto room(size_t pos, size_t n) const -> size_t {
+		auto lo = size_t(0);
+		while (lo < n) {
+			const auto mid = lo + (n - lo) / 2;
+			const auto seq = cells_[(pos + mid) & MASK].seq.load(std::memory_order_acquire);
+			if (static_cast<std::intptr_t>(seq - (pos + mid)) < 0) { n = mid; }
+			else                                                   { lo = mid + 1; }
+		}
+		return n;
+	}
+	alignas(cache_line_size) std::atomic<size_t> tail_ = 0;
+	alignas(cache_line_size) size_t head_              = 0; // Consumer only
+	alignas(cache_line_size) std::array<cell, N> cells_;
+};
+
+} // ez
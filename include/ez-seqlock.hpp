@@ -0,0 +1,148 @@
+#pragma once
+
+#include "ez-cpu.hpp"
+#include "ez-tags.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+namespace ez {
+
+template <typename T> struct seqlock_reader;
+
+// An alternative to ez::sync for small, trivially copyable values which are
+// read at a very high rate by lots of readers, e.g. a 16-64 byte struct read
+// by every voice every block.
+// Reading copies the value out between two loads of a sequence number, and
+// the writer bumps the sequence number before and after writing, so the
+// reader can tell if it raced with a write. A read is just a handful of
+// plain loads and never writes to any shared memory.
+// If a read keeps racing with writes it gives up after a bounded number of
+// attempts rather than spinning, and the caller keeps whatever it had
+// before. seqlock_reader wraps that up by holding on to the last good copy.
+// Any number of threads can read at once. Writers are serialized with a
+// mutex, the same as sync, which with EZ_DEBUG_CHECKS complains if it is
+// taken on a realtime thread.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::seqlock_sync<voice_params> params;
+
+struct voice {
+	ez::seqlock_reader<voice_params> params_reader{params};
+	void process(...) {
+		const auto& p = params_reader.read(ez::audio);
+	}
+};
+
+void ui_thread() {
+	params.update_publish(ez::ui, [](voice_params&& p) { p.cutoff = 0.5f; return p; });
+}
+---------------------------------------------------------------------- */
+template <typename T>
+struct seqlock_sync {
+	static_assert(std::is_trivially_copyable_v<T>, "seqlock_sync is for trivially copyable types. Use ez::sync for anything else.");
+	using value_type = T;
+	seqlock_sync() : seqlock_sync{T{}} {}
+	explicit seqlock_sync(const T& initial) : working_value_{initial} { store(initial); }
+	seqlock_sync(const seqlock_sync&) = delete;
+	seqlock_sync& operator=(const seqlock_sync&) = delete;
+	// Reader ------------------------------------------------------------
+	// Copy the published value into *out and return true, unless every
+	// attempt raced with a write, in which case *out is left alone and this
+	// returns false.
+	[[nodiscard]]
+	auto read(ez::rt_t, T* out, int max_attempts = 4) const -> bool {
+		std::array<uint64_t, WORDS> words;
+		for (int attempt = 0; attempt < max_attempts; attempt++) {
+			const auto before = seq_.load(std::memory_order_acquire);
+			if (before & 1) {
+				// Mid-write.
+				detail::cpu_relax();
+				continue;
+			}
+			for (size_t i = 0; i < WORDS; i++) {
+				words[i] = words_[i].load(std::memory_order_relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (seq_.load(std::memory_order_relaxed) == before) {
+				std::memcpy(static_cast<void*>(out), words.data(), sizeof(T));
+				return true;
+			}
+		}
+		return false;
+	}
+	// Writer ------------------------------------------------------------
+	[[nodiscard]] auto read(ez::nort_t) const -> T              { auto lock = std::lock_guard{mutex_}; return working_value_; }
+	auto gc(ez::gc_t) -> void                                   {}
+	auto publish(ez::nort_t) -> void                            { auto lock = std::lock_guard{mutex_}; store(working_value_); }
+	auto set(ez::nort_t, T value) -> void                       { auto lock = std::lock_guard{mutex_}; working_value_ = value; }
+	auto set_publish(ez::nort_t, T value) -> void               { auto lock = std::lock_guard{mutex_}; working_value_ = value; store(working_value_); }
+	template <typename Fn> auto update(ez::nort_t, Fn fn) -> T  { auto lock = std::lock_guard{mutex_}; working_value_ = fn(std::move(working_value_)); return working_value_; }
+	template <typename Fn> auto update_publish(ez::nort_t, Fn fn) -> T {
+		auto lock = std::lock_guard{mutex_};
+		working_value_ = fn(std::move(working_value_));
+		store(working_value_);
+		return working_value_;
+	}
+	// Never fails. This is just here for symmetry with sync.
+	[[nodiscard]] auto try_publish(ez::nort_t) -> bool          { publish(ez::nort); return true; }
+private:
+	// The published value, copied out under the writer lock, where nothing
+	// can be writing it. Doesn't need to retry.
+	[[nodiscard]] auto read_published() const -> T {
+		auto lock = std::lock_guard{mutex_};
+		std::array<uint64_t, WORDS> words;
+		for (size_t i = 0; i < WORDS; i++) {
+			words[i] = words_[i].load(std::memory_order_relaxed);
+		}
+		T value;
+		std::memcpy(static_cast<void*>(&value), words.data(), sizeof(T));
+		return value;
+	}
+	// The value is stored as relaxed atomic words so that a read which
+	// races with a write is merely discarded rather than undefined.
+	static constexpr size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+	auto store(const T& value) -> void {
+		std::array<uint64_t, WORDS> words{};
+		std::memcpy(words.data(), &value, sizeof(T));
+		const auto seq = seq_.load(std::memory_order_relaxed);
+		seq_.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (size_t i = 0; i < WORDS; i++) {
+			words_[i].store(words[i], std::memory_order_relaxed);
+		}
+		seq_.store(seq + 2, std::memory_order_release);
+	}
+	friend struct seqlock_reader<T>;
+	// Read by the readers.
+	alignas(cache_line_size) std::atomic<uint64_t> seq_ = 0;
+	std::array<std::atomic<uint64_t>, WORDS> words_;
+	// Writer only.
+	alignas(cache_line_size) mutable detail::checked_mutex mutex_;
+	T working_value_;
+};
+
+// Reads from a seqlock_sync and holds on to the last value it read
+// successfully, so read() always has something to return.
+// Each one belongs to one reader at a time. Construct it on a non-realtime
+// thread: it takes the writer lock once to get a first good copy.
+template <typename T>
+struct seqlock_reader {
+	seqlock_reader(const seqlock_sync<T>& sync) : sync_{&sync}, last_good_{sync.read_published()} {}
+	auto read(ez::rt_t) -> const T& {
+		fresh_ = sync_->read(ez::rt, &last_good_);
+		return last_good_;
+	}
+	// False if the last read() gave up and returned the previous value.
+	[[nodiscard]] auto is_fresh(ez::safe_t) const -> bool { return fresh_; }
+private:
+	const seqlock_sync<T>* sync_;
+	T last_good_;
+	bool fresh_ = true;
+};
+
+} // ez
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "ez-cpu.hpp"
+#include "ez-tags.hpp"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+namespace ez {
+
+// A value which lives in memory shared between processes, e.g. state
+// published by a plugin running in a sandbox process and read by the host's
+// audio thread.
+// Everything is inside the object itself, with no pointers, so it can be
+// mapped at a different address in each process. Versions are kept in a
+// fixed number of slots, referred to by index. Each reader claims an entry
+// in a table of readers and announces the slot it is reading there, and the
+// writer never reuses a slot which is current or announced, so reading is
+// zero-copy: readers look straight at the slot.
+// Slots >= Readers + 2, so the writer always has a free slot and never
+// waits for anyone.
+// Mapping the memory is up to you. One process calls create() on the
+// mapped memory and the others call attach(). attach() checks that both
+// sides agree on the layout, including sizeof and alignof T and the cache
+// line size.
+// Example:
+/* ----------------------------------------------------------------------
+using shared_state = ez::shm_value<PluginState>;
+
+// Sandbox
+auto state = shared_state::create(mapping, PluginState{});
+state->set(ez::nort, new_state);
+
+// Host
+auto state  = shared_state::attach(mapping);
+auto reader = shared_state::reader{state};
+void audio_callback(...) {
+	const auto& s = reader.read(ez::audio);
+}
+---------------------------------------------------------------------- */
+// On POSIX the mapping could be, e.g.
+/* ----------------------------------------------------------------------
+// Both processes
+const auto fd = shm_open("/my-plugin-state", O_CREAT | O_RDWR, 0600);
+ftruncate(fd, sizeof(shared_state));
+auto mapping = mmap(nullptr, sizeof(shared_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+---------------------------------------------------------------------- */
+// CAUTION:
+// There may only be one writer thread, across all of the processes. If a
+// process dies while holding a reader then its entry in the reader table
+// stays claimed (and the slot it had announced stays in use) until
+// release_reader() is called for it.
+template <typename T, size_t Slots = 8, size_t Readers = 6>
+struct shm_value {
+	static_assert(std::is_trivially_copyable_v<T>, "shm_value needs a trivially copyable T because it is shared between processes.");
+	static_assert(Slots >= Readers + 2);
+	static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free, "Atomics in shared memory have to be lock-free.");
+	using value_type = T;
+	struct reader;
+	// Construct a shm_value in 'memory', which must be at least
+	// sizeof(shm_value) bytes, aligned to alignof(shm_value).
+	[[nodiscard]]
+	static auto create(void* memory, const T& initial) -> shm_value* {
+		return ::new (memory) shm_value{initial};
+	}
+	// Use a shm_value which was created by another process. Throws if the
+	// memory doesn't look like this kind of shm_value, e.g. because the two
+	// processes were built with different template arguments.
+	[[nodiscard]]
+	static auto attach(void* memory) -> shm_value* {
+		const auto value = std::launder(static_cast<shm_value*>(memory));
+		if (value->layout_ != layout()) {
+			throw std::runtime_error{"That memory doesn't contain a compatible ez::shm_value!"};
+		}
+		return value;
+	}
+	shm_value(const shm_value&) = delete;
+	shm_value& operator=(const shm_value&) = delete;
+	// Writer ------------------------------------------------------------
+	auto set(ez::nort_t, const T& value) -> void {
+		const auto s = find_free_slot();
+		slots_[s].value.value      = value;
+		slots_[s].value.generation = ++generation_;
+		current_.store(s, std::memory_order_seq_cst);
+		current_generation_.store(generation_, std::memory_order_release);
+	}
+	// fn is passed a copy of the current value and returns the new one.
+	template <typename Fn>
+	auto modify(ez::nort_t, Fn&& fn) -> void {
+		set(ez::nort, fn(T{slots_[current_.load(std::memory_order_relaxed)].value.value}));
+	}
+	// Anyone ------------------------------------------------------------
+	// Wait-free. The number of versions published so far.
+	[[nodiscard]]
+	auto generation(ez::safe_t) const -> uint64_t {
+		return current_generation_.load(std::memory_order_acquire);
+	}
+	// Free up a reader table entry which was left claimed by a process that
+	// died. Only call this if you're sure nobody is using it.
+	auto release_reader(ez::nort_t, size_t index) -> void {
+		readers_[index].value.announced.store(NONE, std::memory_order_release);
+		readers_[index].value.in_use.store(0, std::memory_order_release);
+	}
+private:
+	static constexpr uint32_t NONE = UINT32_MAX;
+	struct slot {
+		T value;
+		uint64_t generation;
+	};
+	struct reader_entry {
+		std::atomic<uint32_t> in_use    = 0;
+		std::atomic<uint32_t> announced = NONE;
+	};
+	// Bump this if the layout of shm_value itself changes.
+	static constexpr uint64_t LAYOUT_VERSION = 1;
+	// A hash of everything which affects where things are in the memory,
+	// so that two processes built with different template arguments,
+	// alignment or EZ_CACHE_LINE_SIZE refuse to talk to each other.
+	[[nodiscard]] static constexpr auto layout() -> uint64_t {
+		const uint64_t fields[] = {
+			0xE25E, LAYOUT_VERSION,
+			sizeof(shm_value), alignof(shm_value), cache_line_size,
+			sizeof(T), alignof(T), Slots, Readers,
+		};
+		// FNV-1a, a byte at a time.
+		auto hash = uint64_t(0xcbf29ce484222325);
+		for (const auto field : fields) {
+			for (int byte = 0; byte < 8; byte++) {
+				hash ^= (field >> (byte * 8)) & 0xFF;
+				hash *= 0x100000001b3;
+			}
+		}
+		return hash;
+	}
+	explicit shm_value(const T& initial) {
+		slots_[0].value.value      = initial;
+		slots_[0].value.generation = generation_ = 1;
+		current_.store(0, std::memory_order_relaxed);
+		current_generation_.store(1, std::memory_order_relaxed);
+		// Last, so whoever attaches sees everything else.
+		layout_.store(layout(), std::memory_order_release);
+	}
+	// The writer only needs one slot which is neither current nor announced
+	// by a reader, and there are always at least two of those.
+	// A reader which announces a slot after we have looked at its entry has
+	// loaded an index which was already replaced, so it will notice that
+	// the slot is no longer current and try again without reading it.
+	auto find_free_slot() const -> uint32_t {
+		std::array<bool, Slots> in_use{};
+		in_use[current_.load(std::memory_order_relaxed)] = true;
+		for (const auto& r : readers_) {
+			const auto s = r.value.announced.load(std::memory_order_seq_cst);
+			if (s != NONE) { in_use[s] = true; }
+		}
+		for (uint32_t s = 0; s < Slots; s++) {
+			if (!in_use[s]) { return s; }
+		}
+		// Unreachable because Slots >= Readers + 2.
+		throw std::logic_error{"ez::shm_value ran out of slots!"};
+	}
+	std::atomic<uint64_t> layout_ = 0;
+	// Writer only.
+	uint64_t generation_ = 0;
+	alignas(cache_line_size) std::atomic<uint32_t> current_ = 0;
+	std::atomic<uint64_t> current_generation_ = 0;
+	std::array<padded<reader_entry>, Readers> readers_;
+	std::array<padded<slot>, Slots> slots_;
+	friend struct reader;
+};
+
+// One realtime reader of a shm_value. Claims an entry in the reader table
+// for as long as it exists.
+template <typename T, size_t Slots, size_t Readers>
+struct shm_value<T, Slots, Readers>::reader {
+	// Throws if all of the entries are taken.
+	explicit reader(shm_value* value) : value_{value} {
+		for (size_t i = 0; i < Readers; i++) {
+			auto expected = uint32_t(0);
+			if (value_->readers_[i].value.in_use.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+				entry_ = &value_->readers_[i].value;
+				return;
+			}
+		}
+		throw std::length_error{"Too many readers for this ez::shm_value!"};
+	}
+	reader(const reader&) = delete;
+	reader& operator=(const reader&) = delete;
+	~reader() {
+		entry_->announced.store(NONE, std::memory_order_release);
+		entry_->in_use.store(0, std::memory_order_release);
+	}
+	// The reference is valid until the next call to read().
+	[[nodiscard]]
+	auto read(ez::rt_t) -> const T& {
+		const auto& s = value_->slots_[acquire()].value;
+		generation_   = s.generation;
+		return s.value;
+	}
+	// Which publish the value returned by the last read() came from, or 0
+	// if read() hasn't been called yet.
+	[[nodiscard]]
+	auto generation(ez::rt_t) const -> uint64_t {
+		return generation_;
+	}
+private:
+	auto acquire() -> uint32_t {
+		auto s = value_->current_.load(std::memory_order_acquire);
+		for (;;) {
+			entry_->announced.store(s, std::memory_order_seq_cst);
+			const auto check = value_->current_.load(std::memory_order_seq_cst);
+			if (check == s) { return s; }
+			s = check;
+		}
+	}
+	shm_value* value_;
+	reader_entry* entry_ = nullptr;
+	uint64_t generation_ = 0;
+};
+
+} // ez
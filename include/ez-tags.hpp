@@ -1,19 +1,161 @@
 #pragma once
 
+#include <mutex>
+
+#if defined(EZ_DEBUG_CHECKS)
+#	include <atomic>
+#	include <cstdio>
+#	include <cstdlib>
+#	include <type_traits>
+#	include <utility>
+#endif
+
 namespace ez {
 
+// Debug checks.
+// If EZ_DEBUG_CHECKS is defined then threads can say whether they are
+// realtime or not, and passing the wrong tag from a thread which has said so
+// is reported as a violation. So is taking one of ez's locks, or allocating
+// inside ez, from a realtime thread. The idea is to turn this on in CI and
+// debug builds so latency hazards show up there rather than in a live set.
+// Threads which haven't said what they are aren't checked.
+// By default a violation prints a message and aborts. Install a handler
+// with set_violation_handler() to do something else, e.g. log it and carry
+// on.
+// Without EZ_DEBUG_CHECKS all of this compiles to nothing.
+// Example:
+/* ----------------------------------------------------------------------
+void audio_callback(...) {
+	ez::rt_section rt;
+	// Oops! This takes the writer's lock. With EZ_DEBUG_CHECKS this is caught
+	// when the ez::nort tag is passed.
+	sync.read(ez::nort);
+}
+
+void ui_thread() {
+	ez::this_thread_is_nort();
+	...
+}
+---------------------------------------------------------------------- */
+
+enum class thread_role { unknown, rt, nort };
+
+using violation_handler = void (*)(const char* what);
+
+namespace detail {
+
+#if defined(EZ_DEBUG_CHECKS)
+inline
+auto default_violation_handler(const char* what) -> void {
+	std::fprintf(stderr, "ez: %s\n", what);
+	std::abort();
+}
+
+inline std::atomic<violation_handler> current_violation_handler = default_violation_handler;
+inline thread_local thread_role this_thread_role = thread_role::unknown;
+
+inline
+auto violation(const char* what) -> void {
+	current_violation_handler.load(std::memory_order_acquire)(what);
+}
+#endif
+
+// Called by anything in ez which allocates or takes a lock.
+inline
+auto check_not_rt([[maybe_unused]] const char* what) -> void {
+#if defined(EZ_DEBUG_CHECKS)
+	if (this_thread_role == thread_role::rt) { violation(what); }
+#endif
+}
+
+// A std::mutex which, with EZ_DEBUG_CHECKS, complains if it is locked on a
+// realtime thread. Every writer lock in ez is one of these.
+#if defined(EZ_DEBUG_CHECKS)
+struct checked_mutex {
+	auto lock() -> void   { check_not_rt("Lock taken on a realtime thread."); mutex_.lock(); }
+	auto unlock() -> void { mutex_.unlock(); }
+private:
+	std::mutex mutex_;
+};
+#else
+using checked_mutex = std::mutex;
+#endif
+
+} // detail
+
+// Say what the calling thread is, from here on.
+inline
+auto this_thread_is_rt() -> void {
+#if defined(EZ_DEBUG_CHECKS)
+	detail::this_thread_role = thread_role::rt;
+#endif
+}
+
+inline
+auto this_thread_is_nort() -> void {
+#if defined(EZ_DEBUG_CHECKS)
+	detail::this_thread_role = thread_role::nort;
+#endif
+}
+
+inline
+auto set_violation_handler([[maybe_unused]] violation_handler handler) -> void {
+#if defined(EZ_DEBUG_CHECKS)
+	detail::current_violation_handler.store(handler ? handler : detail::default_violation_handler, std::memory_order_release);
+#endif
+}
+
+// The calling thread is realtime for as long as this exists, then goes back
+// to whatever it was before. For callbacks on threads you don't own, e.g. an
+// audio driver's.
+struct rt_section {
+#if defined(EZ_DEBUG_CHECKS)
+	rt_section() : previous_{std::exchange(detail::this_thread_role, thread_role::rt)} {}
+	~rt_section() { detail::this_thread_role = previous_; }
+	rt_section(const rt_section&) = delete;
+	rt_section& operator=(const rt_section&) = delete;
+private:
+	thread_role previous_;
+#else
+	rt_section() {}
+#endif
+};
+
 // These tags have no runtime cost. The point of them is just to force the user
 // to type ez::rt or ez::nort to reduce the chance of accidentally calling a
 // non-realtime-safe function from a realtime thread.
+// With EZ_DEBUG_CHECKS they do cost something: each time one is passed to a
+// function it checks the calling thread's role.
 
-struct nort_t {}; // Indicates that the calling thread is not a realtime thread.
-struct rt_t {};   // Indicates that the calling thread is a realtime thread.
+struct nort_t { // Indicates that the calling thread is not a realtime thread.
+#if defined(EZ_DEBUG_CHECKS)
+	constexpr nort_t() = default;
+	constexpr nort_t(const nort_t&) {
+		if (!std::is_constant_evaluated() && detail::this_thread_role == thread_role::rt) {
+			detail::violation("ez::nort passed from a realtime thread.");
+		}
+	}
+	constexpr nort_t& operator=(const nort_t&) = default;
+#endif
+};
+
+struct rt_t { // Indicates that the calling thread is a realtime thread.
+#if defined(EZ_DEBUG_CHECKS)
+	constexpr rt_t() = default;
+	constexpr rt_t(const rt_t&) {
+		if (!std::is_constant_evaluated() && detail::this_thread_role == thread_role::nort) {
+			detail::violation("ez::rt passed from a non-realtime thread.");
+		}
+	}
+	constexpr rt_t& operator=(const rt_t&) = default;
+#endif
+};
 
 // Used to indicate that a function is completely thread-safe and realtime-safe.
 struct safe_t {
 	safe_t() = default;
-	safe_t(nort_t){}
-	safe_t(rt_t){}
+	safe_t(const nort_t&){}
+	safe_t(const rt_t&){}
 };
 
 static constexpr auto nort = nort_t{};
@@ -32,6 +174,7 @@ static constexpr auto ui    = nort;
 
 // It is possible for the user to lie about whether they are calling a function
 // from a realtime thread or not. If they do that then I don't guarantee that
-// anything will work the way they expect.
+// anything will work the way they expect (but EZ_DEBUG_CHECKS might catch
+// them.)
 
-} // ez
\ No newline at end of file
+} // ez
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "ez-cpu.hpp"
+#include "ez-tags.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace ez {
+
+// A lighter alternative to ez::sync for small, trivially copyable state
+// like a transport position or a few meter values, with exactly one writer
+// thread and one reader thread.
+// There are three copies of the value: one the writer is filling in, one
+// the reader is looking at, and one in the middle holding the most recently
+// published value. Publishing and reading just swap a buffer with the one
+// in the middle, so both are wait-free, and nothing is allocated, reference
+// counted or garbage collected.
+// The interface is the same shape as sync's, so one can be swapped for the
+// other without changing the call sites. Like sync, read(ez::rt) can be
+// called through a const reference, although it does change which buffer
+// the reader is looking at.
+// CAUTION:
+// Exactly one thread may call read(ez::rt), and the reference it returns is
+// only valid until that thread calls read(ez::rt) again. All of the
+// non-realtime functions must be called from the same thread.
+template <typename T>
+struct triple_buffer {
+	static_assert(std::is_trivially_copyable_v<T>, "triple_buffer is for trivially copyable types. Use ez::sync for anything else.");
+	using value_type = T;
+	// Looks enough like the things sync::read returns.
+	struct ref_type {
+		const T* operator->() const { return value_; }
+		const T& operator*() const  { return *value_; }
+	private:
+		ref_type(const T* value) : value_{value} {}
+		const T* value_;
+		friend struct triple_buffer;
+	};
+	triple_buffer() : triple_buffer{T{}} {}
+	explicit triple_buffer(const T& initial) : working_value_{initial} {
+		for (auto& buffer : buffers_) { buffer.value = initial; }
+	}
+	triple_buffer(const triple_buffer&) = delete;
+	triple_buffer& operator=(const triple_buffer&) = delete;
+	// Reader ------------------------------------------------------------
+	[[nodiscard]]
+	auto read(ez::rt_t) const -> ref_type {
+		if (middle_.load(std::memory_order_relaxed) & FRESH) {
+			// Release so that the writer doesn't reuse the buffer we were
+			// reading until we've finished with it.
+			read_ = middle_.exchange(read_, std::memory_order_acq_rel) & INDEX;
+		}
+		return ref_type{&buffers_[read_].value};
+	}
+	// Writer ------------------------------------------------------------
+	[[nodiscard]] auto read(ez::nort_t) const -> T              { return working_value_; }
+	auto gc(ez::gc_t) -> void                                   {}
+	auto publish(ez::nort_t) -> void                            { publish(working_value_); }
+	auto set(ez::nort_t, T value) -> void                       { working_value_ = value; }
+	auto set_publish(ez::nort_t, T value) -> void               { working_value_ = value; publish(working_value_); }
+	template <typename Fn> auto update(ez::nort_t, Fn fn) -> T  { working_value_ = fn(std::move(working_value_)); return working_value_; }
+	template <typename Fn> auto update_publish(ez::nort_t, Fn fn) -> T {
+		working_value_ = fn(std::move(working_value_));
+		publish(working_value_);
+		return working_value_;
+	}
+	// Never fails. This is just here for symmetry with sync.
+	[[nodiscard]] auto try_publish(ez::nort_t) -> bool          { publish(working_value_); return true; }
+private:
+	static constexpr uint8_t INDEX = 0b011;
+	static constexpr uint8_t FRESH = 0b100;
+	auto publish(const T& value) -> void {
+		buffers_[write_].value = value;
+		write_ = middle_.exchange(write_ | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+	std::array<padded<T>, 3> buffers_;
+	// Index of the middle buffer, with the FRESH bit set if the writer has
+	// put something there which the reader hasn't taken yet.
+	alignas(cache_line_size) mutable std::atomic<uint8_t> middle_ = 1;
+	// Reader only.
+	alignas(cache_line_size) mutable uint8_t read_ = 0;
+	// Writer only.
+	alignas(cache_line_size) uint8_t write_ = 2;
+	T working_value_;
+};
+
+} // ez
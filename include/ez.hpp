@@ -1,15 +1,139 @@
 #pragma once
 
+#include "ez-cpu.hpp"
+#include "ez-gc.hpp"
+#include "ez-hazard.hpp"
 #include "ez-tags.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
-#include <deque>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <list>
 #include <memory>
+#include <memory_resource>
 #include <mutex>
-#include <optional>
+#include <span>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace ez {
 
+// Reclamation policies. Pass one of these as an extra template argument to
+// value, sync etc. to choose how realtime readers keep a version alive.
+// refcount: Readers share an atomic reference count on each version. This
+//           is the default.
+// hazard:   Readers announce the version they are reading in a hazard slot
+//           belonging to their own thread (see ez-hazard.hpp) and the
+//           garbage collector scans those slots. Reading doesn't write to
+//           any memory shared with other threads, so this scales better
+//           when many threads are reading at a high rate. GC passes are a
+//           bit more expensive.
+struct refcount {};
+struct hazard {};
+
+// Writer policies.
+// By default any number of threads may write to a value or sync at once
+// and writers are serialized with a mutex.
+// single_writer: Only one thread ever writes. No locks are taken at all
+//                and writing is wait-free with respect to the garbage
+//                collector. sync::read(ez::nort) may then only be called
+//                from the writer thread.
+struct single_writer {};
+// coalesce:      If the current version has never been picked up by a
+//                reader by the time the next one is published then it is
+//                reclaimed on the spot instead of being handed over to the
+//                garbage collector, and its slot is reused for the version
+//                after that. Use this when a writer publishes far more often
+//                than the readers look, e.g. once per mouse event while a
+//                fader is dragged, so that the number of versions is bounded
+//                by the number of readers rather than the write rate. T's
+//                destructor then sometimes runs on the writer thread (unless
+//                you're also using deferred_destruction.) Not compatible
+//                with the hazard policy.
+struct coalesce {};
+
+// Instrumentation.
+// stats: Keep count of what the value is doing so it can be polled with
+//        stats() and exported somewhere. The counters are relaxed atomics
+//        so they are realtime-safe, but every read() does bump a shared
+//        counter, which costs about as much as the refcount policy does.
+//        Without this policy none of it is compiled in.
+struct stats {};
+
+// Destruction policies.
+// deferred_destruction: The garbage collector doesn't destroy old versions
+//                       itself. It hands them over to a deferred_destroyer
+//                       (ez-gc.hpp) which destroys them on a low priority
+//                       thread, or you can call destroy_deferred() yourself.
+//                       Use this when T's destructor is expensive, e.g. it
+//                       frees a huge sample buffer, and especially with
+//                       auto_gc, where the garbage collector runs inside
+//                       the writer's critical section.
+struct deferred_destruction {};
+
+// Storage policies.
+// arena: Each version gets a bump allocator of its own, and T is built into
+//        it with uses-allocator construction, so a T made of pmr
+//        containers has all of its memory packed together, which is nicer
+//        for readers walking it. Deallocation does nothing. When the
+//        version is reclaimed the arena is rewound, keeping its memory for
+//        the next version to use the same slot, so once the arenas have
+//        grown big enough nothing is allocated or freed at all. T has to be
+//        allocator-aware, i.e. have an allocator_type of
+//        std::pmr::polymorphic_allocator<> and constructors which take one,
+//        and it must not hang on to memory from anywhere else.
+//        CAUTION: try_set() and try_modify() can still allocate if an arena
+//        needs to grow.
+struct arena {};
+// inline_storage: For a sync of a small, trivially copyable T. The
+//                 published value is stored inline instead of in versions,
+//                 so nothing is allocated and there is no garbage. Realtime
+//                 reads return an inline_ref, which holds a copy, rather than
+//                 an immutable. Only combines with refcount, single_writer
+//                 and coalesce, which make no difference here.
+//                 If T plus a 32-bit generation fits in a lock-free atomic
+//                 then that's all there is. Otherwise there are two copies,
+//                 left-right style: readers are wait-free, and a publish
+//                 writes the copy nobody is reading, switches readers over to
+//                 it and then waits for any reader still copying the old one.
+//                 CAUTION: In that case publishing isn't wait-free, even with
+//                 single_writer, because a reader which is preempted in the
+//                 middle of its copy holds up the writer until it's done.
+struct inline_storage {};
+
+// A snapshot of the counters kept by the stats policy. Each counter is read
+// separately so they won't necessarily be exactly consistent with each
+// other.
+struct value_stats {
+	uint64_t publishes     = 0; // Versions published, in total.
+	uint64_t reads         = 0; // Calls to read(), in total.
+	uint64_t versions      = 0; // Versions which currently exist, including the current one.
+	uint64_t peak_versions = 0; // The most versions that have ever existed at once.
+	uint64_t live_versions = 0; // Versions which were still referenced at the end of the last GC pass, including the current one.
+	uint64_t dead_versions = 0; // The rest, i.e. versions waiting to be reclaimed.
+	uint64_t bytes         = 0; // Memory allocated for versions. Doesn't include anything allocated by T itself.
+	uint64_t gc_passes     = 0; // Garbage collection passes, in total.
+	uint64_t reclaimed     = 0; // Versions reclaimed, in total.
+	uint64_t coalesced     = 0; // Versions reclaimed by the writer without a reader ever seeing them, with the coalesce policy.
+	// How long the oldest version which is no longer current, but was still
+	// referenced at the end of the last GC pass, had been retired for. If
+	// this keeps growing then some reader is hanging on to a version. It is
+	// measured from when the garbage collector first saw the version, so
+	// the resolution is however often you run it.
+	std::chrono::nanoseconds max_referenced_age{};
+};
+
+template <typename T> struct immutable;
+template <typename T> struct pinned;
+template <typename T> struct inline_ref;
+
 namespace detail {
 
 // Not for public use.
@@ -18,146 +142,993 @@ struct published_t {
 	published_t(safe_t) {}
 };
 
+template <typename Policy, typename... Policies>
+static constexpr bool has_policy = (std::is_same_v<Policy, Policies> || ...);
+
+template <typename... Policies>
+static constexpr bool use_hazard = has_policy<hazard, Policies...>;
+
+template <typename... Policies>
+static constexpr auto check_policies() -> bool {
+	static_assert(!(has_policy<refcount, Policies...> && has_policy<hazard, Policies...>), "Pick one reclamation policy.");
+	static_assert(!(has_policy<coalesce, Policies...> && has_policy<hazard, Policies...>), "The coalesce policy relies on reference counts.");
+	return true;
+}
+
+template <typename... Policies>
+static constexpr bool use_single_writer = has_policy<single_writer, Policies...>;
+
+template <typename... Policies>
+static constexpr bool use_coalesce = has_policy<coalesce, Policies...>;
+
+template <typename... Policies>
+static constexpr bool use_stats = has_policy<stats, Policies...>;
+
+template <typename... Policies>
+static constexpr bool use_deferred_destruction = has_policy<deferred_destruction, Policies...>;
+
+template <typename... Policies>
+static constexpr bool use_arena = has_policy<arena, Policies...>;
+
+template <typename... Policies>
+static constexpr bool use_inline_storage = has_policy<inline_storage, Policies...>;
+
+// The counters behind the stats policy. Without the policy this is empty
+// and everything is a no-op.
+template <bool Enabled>
+struct stats_counters {
+	stats_counters(std::pmr::memory_resource*) {}
+	auto on_publish() -> void                {}
+	auto on_read() const -> void             {}
+	auto on_allocated(size_t) -> void        {}
+	auto on_coalesced() -> void              {}
+	auto on_retired(const void*) -> void     {}
+	auto on_reclaimed(const void*) -> void   {}
+	auto on_collected(uint64_t) -> void      {}
+};
+
+template <>
+struct stats_counters<true> {
+	using clock = std::chrono::steady_clock;
+	stats_counters(std::pmr::memory_resource* resource) : retired_at_{resource} {}
+	// Writer.
+	auto on_publish() -> void {
+		publishes_.fetch_add(1, std::memory_order_relaxed);
+		const auto versions = versions_.fetch_add(1, std::memory_order_relaxed) + 1;
+		if (versions > peak_versions_.load(std::memory_order_relaxed)) {
+			peak_versions_.store(versions, std::memory_order_relaxed);
+		}
+	}
+	auto on_allocated(size_t bytes) -> void {
+		bytes_.store(bytes, std::memory_order_relaxed);
+	}
+	auto on_coalesced() -> void {
+		versions_.fetch_sub(1, std::memory_order_relaxed);
+		coalesced_.fetch_add(1, std::memory_order_relaxed);
+	}
+	// Readers.
+	auto on_read() const -> void {
+		reads_.fetch_add(1, std::memory_order_relaxed);
+	}
+	// Garbage collector.
+	auto on_retired(const void* version) -> void {
+		retired_at_.push_back({version, clock::now()});
+	}
+	auto on_reclaimed(const void* version) -> void {
+		const auto pos = std::find_if(retired_at_.begin(), retired_at_.end(), [version](const auto& r) { return r.first == version; });
+		assert (pos != retired_at_.end());
+		*pos = retired_at_.back();
+		retired_at_.pop_back();
+		versions_.fetch_sub(1, std::memory_order_relaxed);
+		reclaimed_.fetch_add(1, std::memory_order_relaxed);
+	}
+	auto on_collected(uint64_t still_referenced) -> void {
+		const auto now = clock::now();
+		auto oldest    = now;
+		for (const auto& r : retired_at_) { oldest = std::min(oldest, r.second); }
+		max_referenced_age_.store((now - oldest).count(), std::memory_order_relaxed);
+		// Plus one for the current version.
+		live_versions_.store(still_referenced + 1, std::memory_order_relaxed);
+		gc_passes_.fetch_add(1, std::memory_order_relaxed);
+	}
+	[[nodiscard]]
+	auto get() const -> value_stats {
+		value_stats out;
+		out.publishes          = publishes_.load(std::memory_order_relaxed);
+		out.reads              = reads_.load(std::memory_order_relaxed);
+		out.versions           = versions_.load(std::memory_order_relaxed);
+		out.peak_versions      = peak_versions_.load(std::memory_order_relaxed);
+		out.live_versions      = std::min(out.versions, live_versions_.load(std::memory_order_relaxed));
+		out.dead_versions      = out.versions - out.live_versions;
+		out.bytes              = bytes_.load(std::memory_order_relaxed);
+		out.gc_passes          = gc_passes_.load(std::memory_order_relaxed);
+		out.reclaimed          = reclaimed_.load(std::memory_order_relaxed);
+		out.coalesced          = coalesced_.load(std::memory_order_relaxed);
+		out.max_referenced_age = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::duration{max_referenced_age_.load(std::memory_order_relaxed)});
+		return out;
+	}
+private:
+	std::atomic<uint64_t> publishes_     = 0;
+	alignas(cache_line_size) mutable std::atomic<uint64_t> reads_ = 0;
+	alignas(cache_line_size) std::atomic<uint64_t> versions_      = 0;
+	std::atomic<uint64_t> peak_versions_ = 0;
+	std::atomic<uint64_t> live_versions_ = 0;
+	std::atomic<uint64_t> bytes_         = 0;
+	std::atomic<uint64_t> gc_passes_     = 0;
+	std::atomic<uint64_t> reclaimed_     = 0;
+	std::atomic<uint64_t> coalesced_     = 0;
+	std::atomic<clock::rep> max_referenced_age_ = 0;
+	// Garbage collector only. When each retired version was first seen.
+	std::pmr::vector<std::pair<const void*, clock::time_point>> retired_at_;
+};
+
+struct null_mutex {
+	auto lock() -> void   {}
+	auto unlock() -> void {}
+};
+
+// The mutex used to serialize writers.
+template <typename... Policies>
+using writer_mutex = std::conditional_t<use_single_writer<Policies...>, null_mutex, checked_mutex>;
+
+// The type returned by realtime reads.
+template <typename T, typename... Policies>
+using ref_type = std::conditional_t<use_hazard<Policies...>, pinned<T>, immutable<T>>;
+
 } // detail
 
-template <typename T> struct immutable;
+namespace detail {
+
+// The memory resource behind the arena policy. Blocks come from upstream
+// and are never given back until the arena is destroyed. reset() starts
+// again from the first block.
+struct arena_resource : std::pmr::memory_resource {
+	static constexpr size_t MIN_BLOCK_SIZE = 4096;
+	explicit arena_resource(std::pmr::memory_resource* upstream) : upstream_{upstream} {}
+	arena_resource(const arena_resource&) = delete;
+	arena_resource& operator=(const arena_resource&) = delete;
+	~arena_resource() {
+		while (first_) {
+			const auto next = first_->next;
+			upstream_->deallocate(first_, first_->size, alignof(block));
+			first_ = next;
+		}
+	}
+	auto reset() -> void {
+		current_ = first_;
+		offset_  = sizeof(block);
+	}
+private:
+	struct block {
+		block* next;
+		size_t size;
+	};
+	auto do_allocate(size_t bytes, size_t alignment) -> void* override {
+		for (;;) {
+			if (current_) {
+				const auto base  = reinterpret_cast<uintptr_t>(current_);
+				const auto start = ((base + offset_ + alignment - 1) & ~(alignment - 1)) - base;
+				if (start + bytes <= current_->size) {
+					offset_ = start + bytes;
+					return reinterpret_cast<std::byte*>(current_) + start;
+				}
+				// Try the next block we already have, if any.
+				if (current_->next) {
+					current_ = current_->next;
+					offset_  = sizeof(block);
+					continue;
+				}
+			}
+			add_block(bytes + alignment);
+		}
+	}
+	auto do_deallocate(void*, size_t, size_t) -> void override {}
+	auto do_is_equal(const std::pmr::memory_resource& other) const noexcept -> bool override { return this == &other; }
+	auto add_block(size_t min_bytes) -> void {
+		const auto size = std::max({MIN_BLOCK_SIZE, min_bytes + sizeof(block), current_ ? current_->size * 2 : size_t(0)});
+		const auto b    = static_cast<block*>(upstream_->allocate(size, alignof(block)));
+		b->size = size;
+		// Goes after the current block so that a reset arena fills from the
+		// start again.
+		if (current_) { b->next = current_->next; current_->next = b; }
+		else          { b->next = first_; first_ = b; }
+		current_ = b;
+		offset_  = sizeof(block);
+	}
+	std::pmr::memory_resource* upstream_;
+	block* first_   = nullptr;
+	block* current_ = nullptr;
+	size_t offset_  = 0;
+};
 
-// The reason for storing shared_ptr<optional<T>>s instead of simply
-// shared_ptr<T>s is that we DON'T want to free the memory being used for
-// garbage collected Ts; we want to reuse that memory instead. However we
-// still want to run the T's destructor when it is flagged as dead, and
-// if we did that manually then shared_ptr would end up re-calling the
-// destructor on an already-destroyed T. Using optional<T> just gets us
-// exactly the behavior we want.
+// Storage for one version of a value. T is constructed in place when the
+// version is published and destroyed when it is reclaimed by the garbage
+// collector, but the slot memory itself lives as long as the value does and
+// is recycled.
+// 'refs' is the per-slot state word. A realtime reader may still touch it
+// for a moment after the slot has been recycled (see immutable<T>), which is
+// fine because it never goes away.
+template <typename T>
+struct alignas(cache_line_size) slot {
+	std::atomic<uint32_t> refs = 0;
+	// Links the slot into either the free list or the retired list.
+	slot* next = nullptr;
+	// Which publish this version came from, counting from 1. Written before
+	// the version is published.
+	uint64_t generation = 0;
+	// With the arena policy, where T's memory comes from. Belongs to the
+	// slot from the first time it is used.
+	arena_resource* arena = nullptr;
+	alignas(T) std::byte storage[sizeof(T)];
+	template <typename... Args>
+	auto construct(Args&&... args) -> void { std::construct_at(reinterpret_cast<T*>(&storage), std::forward<Args>(args)...); }
+	auto construct_in_arena(T&& value) -> void {
+		std::uninitialized_construct_using_allocator(reinterpret_cast<T*>(&storage), std::pmr::polymorphic_allocator<>{arena}, std::move(value));
+	}
+	auto destroy() -> void {
+		std::destroy_at(&get());
+		if (arena) { arena->reset(); }
+	}
+	auto get() -> T&                       { return *std::launder(reinterpret_cast<T*>(&storage)); }
+	auto get() const -> const T&           { return *std::launder(reinterpret_cast<const T*>(&storage)); }
+};
 
+// Intrusive lock-free stack of slots.
+// Any number of threads may push. Either one thread at a time may pop, or
+// any number of threads may take everything at once. Having only one popper
+// is what makes this safe from the ABA problem.
 template <typename T>
-struct version {
-	version() : ptr_{std::make_shared<std::optional<T>>()} {}
-	auto clear() -> void                          { ptr_->reset(); }
-	auto set(T value) -> void                     { *ptr_ = std::move(value); }
-	[[nodiscard]] auto is_garbage() const -> bool { return ptr_.use_count() <= 1; }
+struct slot_stack {
+	auto push(slot<T>* s) -> void { push(s, s); }
+	// Push a chain of slots already linked from first to last.
+	auto push(slot<T>* first, slot<T>* last) -> void {
+		auto head = head_.load(std::memory_order_relaxed);
+		do { last->next = head; }
+		while (!head_.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+	}
+	[[nodiscard]]
+	auto pop() -> slot<T>* {
+		auto head = head_.load(std::memory_order_acquire);
+		while (head && !head_.compare_exchange_weak(head, head->next, std::memory_order_acquire, std::memory_order_acquire)) {}
+		if (head) { head->next = nullptr; }
+		return head;
+	}
+	[[nodiscard]]
+	auto take_all() -> slot<T>* {
+		return head_.exchange(nullptr, std::memory_order_acquire);
+	}
+	[[nodiscard]]
+	auto peek() const -> slot<T>* {
+		return head_.load(std::memory_order_acquire);
+	}
 private:
-	std::shared_ptr<std::optional<T>> ptr_;
-	friend struct immutable<T>;
+	std::atomic<slot<T>*> head_ = nullptr;
 };
 
+// Slots are allocated from a memory resource in chunks which are
+// contiguous in memory and never move. Acquiring and releasing a slot are
+// O(1) using an intrusive free list.
+// Only one thread at a time may call acquire() or reserve(), but release()
+// can be called from anywhere.
+template <typename T>
+struct slot_pool {
+	static constexpr size_t MIN_CHUNK_SIZE = 4;
+	slot_pool(std::pmr::memory_resource* resource) : chunks_{resource} {}
+	slot_pool(const slot_pool&) = delete;
+	slot_pool& operator=(const slot_pool&) = delete;
+	~slot_pool() {
+		for (const auto& chunk : chunks_) {
+			chunks_.get_allocator().resource()->deallocate(chunk.slots, chunk.count * sizeof(slot<T>), alignof(slot<T>));
+		}
+	}
+	[[nodiscard]]
+	auto acquire() -> slot<T>* {
+		if (auto s = free_.pop()) { return s; }
+		grow(std::max(MIN_CHUNK_SIZE, size_));
+		return free_.pop();
+	}
+	auto release(slot<T>* s) -> void {
+		free_.push(s);
+	}
+	// Make sure there are at least this many slots in total.
+	auto reserve(size_t count) -> void {
+		if (count > size_) { grow(count - size_); }
+	}
+	// Since only the acquiring thread ever pops from the free list, if this
+	// returns true then the next acquire() won't allocate.
+	[[nodiscard]] auto has_free() const -> bool { return free_.peek(); }
+	[[nodiscard]] auto size() const -> size_t   { return size_; }
+private:
+	struct chunk { slot<T>* slots; size_t count; };
+	auto grow(size_t count) -> void {
+		check_not_rt("Allocation on a realtime thread.");
+		chunks_.reserve(chunks_.size() + 1);
+		const auto slots = static_cast<slot<T>*>(chunks_.get_allocator().resource()->allocate(count * sizeof(slot<T>), alignof(slot<T>)));
+		std::uninitialized_default_construct_n(slots, count);
+		for (size_t i = 0; i + 1 < count; i++) {
+			slots[i].next = &slots[i + 1];
+		}
+		chunks_.push_back({slots, count});
+		free_.push(&slots[0], &slots[count - 1]);
+		size_ += count;
+	}
+	std::pmr::vector<chunk> chunks_;
+	slot_stack<T> free_;
+	size_t size_ = 0;
+};
+
+// The arenas behind the arena policy, one for each slot that has ever been
+// used. Without the policy versions are constructed the normal way.
+template <typename T, bool Enabled>
+struct version_arenas {
+	version_arenas(std::pmr::memory_resource*) {}
+	auto construct(slot<T>* s, T&& value) -> void { s->construct(std::move(value)); }
+};
+
+template <typename T>
+struct version_arenas<T, true> {
+	static_assert(std::uses_allocator_v<T, std::pmr::polymorphic_allocator<>>, "The arena policy needs an allocator-aware T.");
+	version_arenas(std::pmr::memory_resource* resource) : arenas_{resource} {}
+	// Writer.
+	auto construct(slot<T>* s, T&& value) -> void {
+		if (!s->arena) { s->arena = &arenas_.emplace_back(arenas_.get_allocator().resource()); }
+		s->construct_in_arena(std::move(value));
+	}
+private:
+	std::pmr::list<arena_resource> arenas_;
+};
+
+// Reclaimed versions waiting to be destroyed, for the deferred_destruction
+// policy. Without the policy defer() refuses everything and the garbage
+// collector destroys versions itself.
+template <typename T, bool Enabled>
+struct doomed_versions {
+	doomed_versions(slot_pool<T>*) {}
+	auto defer(slot<T>*) -> bool { return false; }
+	auto notify() -> void        {}
+	auto detach() -> void        {}
+};
+
+template <typename T>
+struct doomed_versions<T, true> {
+	doomed_versions(slot_pool<T>* pool) : pool_{pool} {}
+	// Called by the garbage collector.
+	auto defer(slot<T>* s) -> bool {
+		doomed_.push(s);
+		return true;
+	}
+	// Let the deferred_destroyer know about anything deferred since the
+	// last call.
+	auto notify() -> void {
+		if (doomed_.peek()) { client_.mark_dirty(); }
+	}
+	// Can be called from any thread.
+	auto destroy_all() -> void {
+		auto s = doomed_.take_all();
+		while (s) {
+			const auto next = s->next;
+			s->destroy();
+			pool_->release(s);
+			s = next;
+		}
+	}
+	auto detach() -> void {
+		client_.detach();
+		destroy_all();
+	}
+	[[nodiscard]] auto client() -> gc_client& { return client_; }
+private:
+	slot_pool<T>* pool_;
+	slot_stack<T> doomed_;
+	gc_client client_{this, [](void* self) { static_cast<doomed_versions*>(self)->destroy_all(); return false; }};
+};
+
+} // detail
+
 template <typename T>
 struct immutable {
 	immutable() = default;
-	immutable(version<T> v) : ptr_{std::move(v.ptr_)} {}
-	const T* operator->() const { return &ptr_->value(); }
-	const T& operator*() const  { return ptr_->value(); }
+	immutable(const std::atomic<detail::slot<T>*>& src) {
+		// The slot could be retired and reclaimed between loading the pointer
+		// and taking the reference, so check that it is still current after
+		// taking the reference. If it isn't then we haven't looked at the
+		// value yet so we can just drop the reference and try again.
+		// The acquire here pairs with the release when the writer drops its
+		// own reference to the previous version, so if that has happened
+		// then we are guaranteed to see the new pointer.
+		auto s = src.load(std::memory_order_acquire);
+		assert (s && "Value was never set!");
+		for (;;) {
+			s->refs.fetch_add(1, std::memory_order_acquire);
+			const auto check = src.load(std::memory_order_acquire);
+			if (check == s) { break; }
+			s->refs.fetch_sub(1, std::memory_order_release);
+			s = check;
+		}
+		slot_ = s;
+	}
+	immutable(const immutable& rhs) : slot_{rhs.slot_} { retain(); }
+	immutable(immutable&& rhs) noexcept : slot_{std::exchange(rhs.slot_, nullptr)} {}
+	immutable& operator=(const immutable& rhs) {
+		if (slot_ != rhs.slot_) { release(); slot_ = rhs.slot_; retain(); }
+		return *this;
+	}
+	immutable& operator=(immutable&& rhs) noexcept {
+		if (this != &rhs) { release(); slot_ = std::exchange(rhs.slot_, nullptr); }
+		return *this;
+	}
+	~immutable() { release(); }
+	const T* operator->() const { return &slot_->get(); }
+	const T& operator*() const  { return slot_->get(); }
+	// Which publish this version came from. See value::generation().
+	[[nodiscard]] auto generation() const -> uint64_t { return slot_->generation; }
 private:
-	// The underlying optional accessible though this interface
-	// is logically guaranteed to always hold a value.
-	std::shared_ptr<const std::optional<T>> ptr_;
+	auto retain() -> void { if (slot_) { slot_->refs.fetch_add(1, std::memory_order_relaxed); } }
+	auto release() -> void {
+		if (slot_) {
+			slot_->refs.fetch_sub(1, std::memory_order_release);
+			slot_ = nullptr;
+		}
+	}
+	detail::slot<T>* slot_ = nullptr;
+};
+
+// Like immutable<T> but for the hazard reclamation policy. Holding one of
+// these occupies one of the calling thread's hazard slots. Copying is
+// allowed but each copy occupies another slot on the copying thread.
+template <typename T>
+struct pinned {
+	pinned() = default;
+	pinned(const std::atomic<detail::slot<T>*>& src)
+		: hazard_{&detail::this_thread_hazard_record()}
+		, slot_{hazard_.protect(src)}
+	{
+		assert (slot_ && "Value was never set!");
+	}
+	pinned(const pinned& rhs) { *this = rhs; }
+	pinned(pinned&& rhs) noexcept
+		: hazard_{std::move(rhs.hazard_)}
+		, slot_{std::exchange(rhs.slot_, nullptr)}
+	{
+	}
+	pinned& operator=(pinned&& rhs) noexcept {
+		if (this != &rhs) {
+			hazard_ = std::move(rhs.hazard_);
+			slot_   = std::exchange(rhs.slot_, nullptr);
+		}
+		return *this;
+	}
+	pinned& operator=(const pinned& rhs) {
+		if (this == &rhs) { return *this; }
+		if (!rhs.slot_) {
+			*this = pinned{};
+			return *this;
+		}
+		if (!hazard_.is_held()) {
+			hazard_ = detail::hazard_slot{&detail::this_thread_hazard_record()};
+		}
+		hazard_.announce(rhs.slot_);
+		slot_ = rhs.slot_;
+		return *this;
+	}
+	const T* operator->() const { return &slot_->get(); }
+	const T& operator*() const  { return slot_->get(); }
+	// Which publish this version came from. See value::generation().
+	[[nodiscard]] auto generation() const -> uint64_t { return slot_->generation; }
+private:
+	detail::hazard_slot hazard_;
+	const detail::slot<T>* slot_ = nullptr;
+};
+
+// A version of a value along with which publish it came from. Holding one
+// keeps the version alive, the same as holding the ref it contains.
+// Example:
+/* ----------------------------------------------------------------------
+void widget::paint() {
+	const auto snap = project.snapshot(ez::ui);
+	if (snap.generation == last_painted_) { return; }
+	last_painted_ = snap.generation;
+	draw(*snap);
+}
+---------------------------------------------------------------------- */
+template <typename Ref>
+struct snapshot {
+	auto operator->() const { return value.operator->(); }
+	decltype(auto) operator*() const { return *value; }
+	Ref value;
+	uint64_t generation = 0;
+};
+
+// What a sync with the inline_storage policy reads through: a copy of the
+// value, and which publish it came from. Holding one doesn't keep anything
+// alive.
+template <typename T>
+struct inline_ref {
+	inline_ref() = default;
+	inline_ref(const T& value, uint64_t generation) : value_{value}, generation_{generation} {}
+	const T* operator->() const { return &value_; }
+	const T& operator*() const  { return value_; }
+	// Which publish this copy came from. See value::generation().
+	[[nodiscard]] auto generation() const -> uint64_t { return generation_; }
+private:
+	T value_{};
+	uint64_t generation_ = 0;
 };
 
-// Shared pointers to old versions of the value are kept in a list to ensure that they are
-// not reclaimed if released by a realtime reader thread.
+// Each published version of the value lives in a slot. When a new version
+// is published the previous one is handed over to the garbage collector,
+// which only looks at those retired versions, reclaiming the ones which are
+// no longer referenced by any realtime reader.
+// The garbage collector never takes the writer mutex. If garbage_collect()
+// is called while another call is still in progress on another thread then
+// it just returns.
 // The memory allocated for different versions of the data is reused to avoid unnecessary
-// (de)allocations.
+// (de)allocations. It comes from a std::pmr::memory_resource (the default one unless you
+// pass one in) and can be allocated up front with reserve(). If the writer must never
+// allocate then use try_set() and try_modify(), which report back-pressure by returning
+// false instead of allocating when every slot is still in use.
 // If the template parameter 'auto_gc' is set to false then garbage_collect() should be called
 // periodically to reclaim memory. You could do this every time you modify the value if
 // you want, which is what 'auto_gc' would do.
 // Or you could have a background thread that calls garbage_collect() on a timer or whatever.
+// If you have lots of values then register them with a gc_scheduler (ez-gc.hpp) instead,
+// which only visits the ones that need it.
 // The garbage collection operation is relatively inexpensive.
 // Note that if T has a destructor then it won't be run until it is reclaimed by the garbage
 // collection routine.
-// Every public function here is thread-safe.
-// Only read() is lock-free.
+// Every public function here is thread-safe, except that with the
+// single_writer policy only one thread may call modify() or set().
+// read() and garbage_collect() are lock-free, and so is everything else with
+// the single_writer policy.
 // Multiple simultaneous realtime readers are supported.
-template <typename T, bool auto_gc = false>
+// Extra template arguments are policy tags, e.g. ez::hazard.
+template <typename T, bool auto_gc = false, typename... Policies>
 struct value {
+	static_assert(detail::check_policies<Policies...>());
+	static_assert(!detail::use_inline_storage<Policies...>, "The inline_storage policy is for sync.");
+	using value_type = T;
+	using ref_type   = detail::ref_type<T, Policies...>;
+	value() : value{std::pmr::get_default_resource()} {}
+	explicit value(std::pmr::memory_resource* resource) : pool_{resource}, arenas_{resource}, hazard_buffer_{resource}, stats_{resource} {}
+	value(const value&) = delete;
+	value& operator=(const value&) = delete;
+	~value() {
+		// Must come first so that a gc_scheduler pass can't be in here.
+		scheduler_client_.detach();
+		doomed_.detach();
+		if (current_) { current_->destroy(); }
+		for (auto s = retired_; s; s = s->next)               { s->destroy(); }
+		for (auto s = handed_over_.peek(); s; s = s->next) { s->destroy(); }
+	}
+	// update_fn is passed a copy of the current value (or a default
+	// constructed T if nothing has been set yet) and returns the new value.
 	template <typename UpdateFn>
 	auto modify(ez::nort_t, UpdateFn&& update_fn) -> void {
-		auto lock = std::unique_lock{writer_mutex_};
-		auto new_value = update_fn(std::move(writer_value_));
-		writer_value_ = new_value;
-		const auto index = get_empty_version();
-		current_version_ = versions_[index];
-		versions_[index].set(std::move(new_value));
-		dead_flags_[index] = false;
-		current_version_ptr_.store(&versions_[index], std::memory_order_release);
-		if constexpr (auto_gc) { garbage_collect(lock); }
+		auto lock = std::lock_guard{writer_mutex_};
+		emplace_version(update_fn(current_ ? T{current_->get()} : T{}));
 	}
+	// The value is moved into the new version without being copied.
 	auto set(ez::nort_t, T value) -> void {
-		modify(ez::nort, [value = std::move(value)](T&&) mutable { return std::move(value); });
+		auto lock = std::lock_guard{writer_mutex_};
+		emplace_version(std::move(value));
+	}
+	// Like modify() and set() but these never allocate. If there are no
+	// free slots then they return false without doing anything (in
+	// particular, update_fn isn't called and value isn't moved from.)
+	template <typename UpdateFn> [[nodiscard]]
+	auto try_modify(ez::nort_t, UpdateFn&& update_fn) -> bool {
+		auto lock = std::lock_guard{writer_mutex_};
+		if (!pool_.has_free()) { return false; }
+		emplace_version(update_fn(current_ ? T{current_->get()} : T{}));
+		return true;
+	}
+	[[nodiscard]]
+	auto try_set(ez::nort_t, T&& value) -> bool {
+		auto lock = std::lock_guard{writer_mutex_};
+		if (!pool_.has_free()) { return false; }
+		emplace_version(std::move(value));
+		return true;
+	}
+	[[nodiscard]]
+	auto try_set(ez::nort_t, const T& value) -> bool {
+		auto lock = std::lock_guard{writer_mutex_};
+		if (!pool_.has_free()) { return false; }
+		emplace_version(T{value});
+		return true;
+	}
+	// Allocate enough slots for this many versions to exist at once.
+	auto reserve(ez::nort_t, size_t count) -> void {
+		auto lock = std::lock_guard{writer_mutex_};
+		pool_.reserve(count);
+	}
+	[[nodiscard]]
+	auto capacity(ez::nort_t) -> size_t {
+		auto lock = std::lock_guard{writer_mutex_};
+		return pool_.size();
+	}
+	auto read(ez::safe_t) const -> ref_type {
+		stats_.on_read();
+		return ref_type{current_ptr_};
 	}
-	auto read(ez::safe_t) const -> immutable<T> {
-		auto version = *current_version_ptr_.load(std::memory_order_acquire);
-		return immutable<T>{version};
+	// Wait-free. The number of versions published so far, which is also the
+	// generation() of the current version. Cheap enough to check every
+	// block, e.g. to only recompute something derived from the value when
+	// this has changed. Once you've seen a generation here, read() returns
+	// that version or a later one.
+	[[nodiscard]]
+	auto generation(ez::safe_t) const -> uint64_t {
+		return current_generation_.load(std::memory_order_acquire);
+	}
+	[[nodiscard]]
+	auto snapshot(ez::safe_t) const -> ez::snapshot<ref_type> {
+		auto ref = read(ez::safe);
+		const auto generation = ref.generation();
+		return {std::move(ref), generation};
 	}
 	auto garbage_collect(ez::gc_t) -> void {
-		garbage_collect(std::unique_lock{writer_mutex_});
+		static_cast<void>(try_garbage_collect());
+	}
+	// Only available with the ez::deferred_destruction policy. Destroy the
+	// versions which the garbage collector has reclaimed since the last
+	// call. You don't need this if you're using a deferred_destroyer.
+	auto destroy_deferred(ez::nort_t) -> void requires detail::use_deferred_destruction<Policies...> {
+		doomed_.destroy_all();
+	}
+	// Not for public use. See gc_scheduler and deferred_destroyer.
+	[[nodiscard]] auto gc_client(ez::nort_t) -> detail::gc_client& { return scheduler_client_; }
+	[[nodiscard]] auto destroyer_client(ez::nort_t) -> detail::gc_client& requires detail::use_deferred_destruction<Policies...> { return doomed_.client(); }
+	// Only available with the ez::stats policy.
+	[[nodiscard]]
+	auto stats(ez::safe_t) const -> value_stats requires detail::use_stats<Policies...> {
+		return stats_.get();
 	}
 private:
-	auto garbage_collect(std::unique_lock<std::mutex>&& lock) -> void {
-		for (auto index : get_alive_versions(&index_buffer_)) {
-			if (versions_[index].is_garbage()) {
-				kill(index);
+	// A hazard reader validates the pointer it announced with a sequentially
+	// consistent load, so the store has to take part in that ordering too.
+	static constexpr auto publish_order = detail::use_hazard<Policies...> ? std::memory_order_seq_cst : std::memory_order_release;
+	auto emplace_version(T&& value) -> void {
+		const auto s = pool_.acquire();
+		arenas_.construct(s, std::move(value));
+		s->generation = ++generation_;
+		stats_.on_allocated(pool_.size() * sizeof(detail::slot<T>));
+		stats_.on_publish();
+		// The value holds a reference to the current version so that it
+		// is never considered garbage.
+		s->refs.fetch_add(1, std::memory_order_relaxed);
+		current_ptr_.store(s, publish_order);
+		current_generation_.store(generation_, std::memory_order_release);
+		if (current_) { retire_current(); }
+		current_ = s;
+		if constexpr (auto_gc) { garbage_collect(ez::gc); }
+		scheduler_client_.mark_dirty();
+	}
+	// Drop the writer's reference to the version which has just been
+	// replaced and hand it over to the garbage collector.
+	// With the coalesce policy, if that was the only reference then no
+	// reader has it and none can get it any more: a reader which takes a
+	// reference after this sees the new pointer when it checks, and backs
+	// off (see immutable<T>). The acquire makes sure any reader which did
+	// have it has finished with it.
+	auto retire_current() -> void {
+		if constexpr (detail::use_coalesce<Policies...>) {
+			if (current_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				stats_.on_coalesced();
+				if (!doomed_.defer(current_)) {
+					current_->destroy();
+					pool_.release(current_);
+				}
+				doomed_.notify();
+				return;
 			}
 		}
+		else {
+			current_->refs.fetch_sub(1, std::memory_order_release);
+		}
+		handed_over_.push(current_);
 	}
-	auto kill(size_t index) -> void {
-		versions_[index].clear();
-		dead_flags_[index] = true;
+	// Returns true if there is still something left to collect afterwards.
+	auto try_garbage_collect() -> bool {
+		if (collecting_.test_and_set(std::memory_order_acquire)) { return true; }
+		take_handed_over();
+		stats_.on_collected(collect());
+		const auto remaining = retired_ != nullptr;
+		collecting_.clear(std::memory_order_release);
+		return remaining;
 	}
-	auto get_alive_versions(std::vector<size_t>* out) const -> const std::vector<size_t>& {
-		out->clear();
-		for (size_t i = 0; i < dead_flags_.size(); i++) {
-			if (!dead_flags_[i]) { out->push_back(i); }
+	auto take_handed_over() -> void {
+		auto s = handed_over_.take_all();
+		while (s) {
+			auto next = s->next;
+			s->next   = retired_;
+			retired_  = s;
+			s         = next;
+			stats_.on_retired(retired_);
 		}
-		return *out;
 	}
-	auto get_empty_version() -> size_t {
-		for (size_t i = 0; i < dead_flags_.size(); i++) {
-			if (dead_flags_[i]) { return i; }
+	// Returns the number of retired versions which are still referenced.
+	auto collect() -> uint64_t {
+		if (!retired_) { return 0; }
+		if constexpr (detail::use_hazard<Policies...>) {
+			detail::collect_hazards(&hazard_buffer_);
 		}
-		auto index = size_t{versions_.size()};
-		versions_.emplace_back();
-		dead_flags_.push_back(true);
-		assert ((index + 1) == versions_.size() && (index + 1) == dead_flags_.size());
-		return index;
-	}
-	T writer_value_;
-	std::mutex writer_mutex_;
-	std::atomic<version<T>*> current_version_ptr_ = nullptr;
-	// We hold this just to keep the refcount > 1 so that the current
-	// version is not considered garbage.
-	version<T> current_version_;
-	std::deque<version<T>> versions_;
-	std::vector<bool> dead_flags_;
-	std::vector<size_t> index_buffer_;
+		auto link      = &retired_;
+		auto remaining = uint64_t(0);
+		while (auto s = *link) {
+			if (is_garbage(*s)) {
+				*link = s->next;
+				stats_.on_reclaimed(s);
+				if (!doomed_.defer(s)) {
+					s->destroy();
+					pool_.release(s);
+				}
+			}
+			else {
+				link = &s->next;
+				remaining++;
+			}
+		}
+		doomed_.notify();
+		return remaining;
+	}
+	auto is_garbage(const detail::slot<T>& s) const -> bool {
+		if (s.refs.load(std::memory_order_acquire) > 0) { return false; }
+		if constexpr (detail::use_hazard<Policies...>) {
+			return !detail::is_hazard(hazard_buffer_, &s);
+		}
+		return true;
+	}
+	// Writer state.
+	detail::writer_mutex<Policies...> writer_mutex_;
+	detail::slot<T>* current_ = nullptr;
+	detail::slot_pool<T> pool_;
+	[[no_unique_address]] detail::version_arenas<T, detail::use_arena<Policies...>> arenas_;
+	uint64_t generation_ = 0;
+	// Shared state. The pointer to the current version and its generation
+	// are the only things readers touch, so they get a cache line to
+	// themselves, away from the writer and the garbage collector.
+	alignas(cache_line_size) std::atomic<detail::slot<T>*> current_ptr_ = nullptr;
+	std::atomic<uint64_t> current_generation_ = 0;
+	alignas(cache_line_size) detail::slot_stack<T> handed_over_;
+	// Garbage collector state.
+	std::atomic_flag collecting_;
+	detail::slot<T>* retired_ = nullptr;
+	std::pmr::vector<const void*> hazard_buffer_;
+	[[no_unique_address]] detail::stats_counters<detail::use_stats<Policies...>> stats_;
+	detail::gc_client scheduler_client_{this, [](void* self) { return static_cast<value*>(self)->try_garbage_collect(); }};
+	[[no_unique_address]] detail::doomed_versions<T, detail::use_deferred_destruction<Policies...>> doomed_{&pool_};
 };
 
+namespace detail {
+
+// What atomic_storage keeps in its atomic: the value, and the bottom 32 bits
+// of the generation it was published with.
+template <typename T>
+struct inline_packed {
+	T value;
+	uint32_t generation;
+};
+
+template <typename T>
+static constexpr bool fits_atomic_storage = std::atomic<inline_packed<T>>::is_always_lock_free;
+
+// Published storage for an inline_storage sync whose T, with a 32-bit
+// generation, fits in a lock-free atomic. There is nothing to collect, so
+// the gc_client never has anything to do.
+// The full generation is stored before the value, so a reader who has seen
+// the value sees that generation or a later one, and can recover the top 32
+// bits from it as long as fewer than 2^32 publishes happen in between.
+// Not thread-safe for writers. The sync serializes them.
+template <typename T>
+struct atomic_storage {
+	using ref_type = inline_ref<T>;
+	atomic_storage() = default;
+	explicit atomic_storage(std::pmr::memory_resource*) {}
+	auto set(ez::nort_t, T value) -> void {
+		const auto generation = generation_.load(std::memory_order_relaxed) + 1;
+		generation_.store(generation, std::memory_order_release);
+		packed_.store({value, uint32_t(generation)}, std::memory_order_release);
+	}
+	[[nodiscard]] auto try_set(ez::nort_t, const T& value) -> bool { set(ez::nort, value); return true; }
+	[[nodiscard]] auto read(ez::safe_t) const -> ref_type {
+		const auto packed = packed_.load(std::memory_order_acquire);
+		return {packed.value, full_generation(packed.generation)};
+	}
+	[[nodiscard]] auto snapshot(ez::safe_t) const -> ez::snapshot<ref_type> {
+		const auto ref = read(ez::safe);
+		return {ref, ref.generation()};
+	}
+	[[nodiscard]] auto generation(ez::safe_t) const -> uint64_t    { return full_generation(packed_.load(std::memory_order_acquire).generation); }
+	auto garbage_collect(ez::gc_t) -> void                         {}
+	auto reserve(ez::nort_t, size_t) -> void                       {}
+	[[nodiscard]] auto gc_client(ez::nort_t) -> detail::gc_client& { return scheduler_client_; }
+private:
+	// Must be called after loading the packed value.
+	[[nodiscard]] auto full_generation(uint32_t bottom) const -> uint64_t {
+		const auto latest = generation_.load(std::memory_order_acquire);
+		return latest - uint32_t(uint32_t(latest) - bottom);
+	}
+	alignas(cache_line_size) std::atomic<inline_packed<T>> packed_{};
+	std::atomic<uint64_t> generation_ = 0;
+	alignas(cache_line_size) detail::gc_client scheduler_client_{this, [](void*) { return false; }};
+};
+
+// Published storage for an inline_storage sync whose T is too big for
+// atomic_storage. There are two instances of the value, left-right style.
+// A reader registers in one of two counters, copies whichever instance is
+// current and deregisters, so it never has to retry. A publish writes the
+// instance nobody is reading, makes it current, and then waits for first
+// one counter and then the other to drain, after which nobody can still be
+// copying the old instance when the next publish overwrites it.
+// CAUTION:
+// Reading is wait-free but publishing isn't. See inline_storage.
+// Not thread-safe for writers. The sync serializes them.
+template <typename T>
+struct left_right_storage {
+	using ref_type = inline_ref<T>;
+	left_right_storage() = default;
+	explicit left_right_storage(std::pmr::memory_resource*) {}
+	auto set(ez::nort_t, T value) -> void {
+		const auto generation = generation_.load(std::memory_order_relaxed) + 1;
+		const auto next       = 1 - current_.load(std::memory_order_relaxed);
+		instances_[next].value = {value, generation};
+		current_.store(next, std::memory_order_seq_cst);
+		generation_.store(generation, std::memory_order_release);
+		const auto counter = counter_.load(std::memory_order_relaxed);
+		wait_for_readers(1 - counter);
+		counter_.store(1 - counter, std::memory_order_seq_cst);
+		wait_for_readers(counter);
+	}
+	[[nodiscard]] auto try_set(ez::nort_t, const T& value) -> bool { set(ez::nort, value); return true; }
+	[[nodiscard]] auto read(ez::safe_t) const -> ref_type {
+		auto& readers = readers_[counter_.load(std::memory_order_seq_cst)].value;
+		readers.fetch_add(1, std::memory_order_seq_cst);
+		const auto& instance = instances_[current_.load(std::memory_order_seq_cst)].value;
+		const auto ref       = ref_type{instance.value, instance.generation};
+		readers.fetch_sub(1, std::memory_order_release);
+		return ref;
+	}
+	[[nodiscard]] auto snapshot(ez::safe_t) const -> ez::snapshot<ref_type> {
+		const auto ref = read(ez::safe);
+		return {ref, ref.generation()};
+	}
+	[[nodiscard]] auto generation(ez::safe_t) const -> uint64_t    { return generation_.load(std::memory_order_acquire); }
+	auto garbage_collect(ez::gc_t) -> void                         {}
+	auto reserve(ez::nort_t, size_t) -> void                       {}
+	[[nodiscard]] auto gc_client(ez::nort_t) -> detail::gc_client& { return scheduler_client_; }
+private:
+	// Readers only hold a counter for as long as it takes to copy T, so spin
+	// for a bit before giving up the CPU.
+	auto wait_for_readers(int counter) const -> void {
+		for (int spins = 0; readers_[counter].value.load(std::memory_order_seq_cst) != 0; spins++) {
+			if (spins < 64) { detail::cpu_relax(); }
+			else            { std::this_thread::yield(); }
+		}
+	}
+	struct instance {
+		T value{};
+		uint64_t generation = 0;
+	};
+	std::array<padded<instance>, 2> instances_;
+	mutable std::array<padded<std::atomic<uint32_t>>, 2> readers_;
+	alignas(cache_line_size) std::atomic<int> current_ = 0;
+	std::atomic<int> counter_                          = 0;
+	std::atomic<uint64_t> generation_                  = 0;
+	alignas(cache_line_size) detail::gc_client scheduler_client_{this, [](void*) { return false; }};
+};
+
+// What a sync publishes into.
+template <typename T, bool auto_gc, bool Inline, typename... Policies>
+struct pick_sync_storage { using type = ez::value<T, auto_gc, Policies...>; };
+
+template <typename T, bool auto_gc, typename... Policies>
+struct pick_sync_storage<T, auto_gc, true, Policies...> {
+	static_assert(std::is_trivially_copyable_v<T>, "The inline_storage policy needs a trivially copyable T.");
+	static_assert(((std::is_same_v<Policies, inline_storage> || std::is_same_v<Policies, refcount> || std::is_same_v<Policies, single_writer> || std::is_same_v<Policies, coalesce>) && ...),
+		"The inline_storage policy only combines with refcount, single_writer and coalesce.");
+	using type = std::conditional_t<fits_atomic_storage<T>, atomic_storage<T>, left_right_storage<T>>;
+};
+
+template <typename T, bool auto_gc, typename... Policies>
+using sync_storage = typename pick_sync_storage<T, auto_gc, use_inline_storage<Policies...>, Policies...>::type;
+
+} // detail
+
 // An 'update' or 'set' operation changes the working value, but does not yet
 // commit the change to be visible to realtime readers.
 // A 'publish' operation makes the new value visible to realtime readers.
-template <typename T, bool auto_gc = false>
+// With the single_writer policy all of the non-realtime functions must be
+// called from the same thread, and none of them take a lock.
+// With the inline_storage policy the published value is stored inline
+// rather than in versions, and realtime reads return copies. See
+// inline_storage.
+template <typename T, bool auto_gc = false, typename... Policies>
 struct sync {
+	static_assert(detail::check_policies<Policies...>());
+	using value_type = T;
+	using ref_type   = typename detail::sync_storage<T, auto_gc, Policies...>::ref_type;
 	sync()                                                             { publish(ez::nort); }
+	// Versions are allocated from the given memory resource. 'reserve'
+	// slots are allocated up front, before the initial value is published.
+	explicit sync(std::pmr::memory_resource* resource, size_t reserve = 0)
+		: published_value_{resource}
+	{
+		published_value_.reserve(ez::nort, reserve);
+		publish(ez::nort);
+	}
 	[[nodiscard]] auto read(ez::nort_t) const -> T                     { auto lock = std::lock_guard{mutex_}; return working_value_; }
-	[[nodiscard]] auto read(detail::published_t) const -> immutable<T> { return published_value_.read(ez::safe); }
+	[[nodiscard]] auto read(detail::published_t) const -> ref_type     { return published_value_.read(ez::safe); }
+	// Lock-free. The published value, shared rather than copied, and which
+	// publish it came from, so a reader can tell if anything has changed
+	// since it last looked. For UI code which doesn't need to see changes
+	// that haven't been published yet. They would need read(ez::nort).
+	[[nodiscard]] auto snapshot(ez::nort_t) const -> ez::snapshot<ref_type> { return published_value_.snapshot(ez::safe); }
+	// Wait-free. See value::generation().
+	[[nodiscard]] auto generation(ez::safe_t) const -> uint64_t        { return published_value_.generation(ez::safe); }
 	auto gc(ez::gc_t) -> void                                          { published_value_.garbage_collect(ez::gc); }
-	auto publish(ez::nort_t) -> void                                   { published_value_.set(ez::nort, working_value_); }
+	// Only available with the ez::deferred_destruction policy.
+	auto destroy_deferred(ez::nort_t) -> void requires detail::use_deferred_destruction<Policies...> { published_value_.destroy_deferred(ez::nort); }
+	// Not for public use. See gc_scheduler and deferred_destroyer.
+	[[nodiscard]] auto gc_client(ez::nort_t) -> detail::gc_client&    { return published_value_.gc_client(ez::nort); }
+	[[nodiscard]] auto destroyer_client(ez::nort_t) -> detail::gc_client& requires detail::use_deferred_destruction<Policies...> { return published_value_.destroyer_client(ez::nort); }
+	auto publish(ez::nort_t) -> void                                   { auto lock = std::lock_guard{mutex_}; published_value_.set(ez::nort, working_value_); }
 	auto set(ez::nort_t, T value) -> void                              { auto lock = std::lock_guard{mutex_}; working_value_ = std::move(value); }
-	auto set_publish(ez::nort_t, T value) -> void                      { set(ez::nort, std::move(value)); publish(ez::nort); }
+	auto set_publish(ez::nort_t, T value) -> void                      { auto lock = std::lock_guard{mutex_}; working_value_ = std::move(value); published_value_.set(ez::nort, working_value_); }
 	template <typename Fn> auto update(ez::nort_t, Fn fn) -> T         { auto lock = std::lock_guard{mutex_}; working_value_ = fn(std::move(working_value_)); return working_value_; }
-	template <typename Fn> auto update_publish(ez::nort_t, Fn fn) -> T { auto value = update(ez::nort, fn); publish(ez::nort); return value; }
+	template <typename Fn> auto update_publish(ez::nort_t, Fn fn) -> T { auto lock = std::lock_guard{mutex_}; working_value_ = fn(std::move(working_value_)); published_value_.set(ez::nort, working_value_); return working_value_; }
+	auto reserve(ez::nort_t, size_t count) -> void                     { published_value_.reserve(ez::nort, count); }
+	// Only available with the ez::stats policy.
+	[[nodiscard]] auto stats(ez::safe_t) const -> value_stats requires detail::use_stats<Policies...> { return published_value_.stats(ez::safe); }
+	// Publish without allocating. Returns false if there was no free slot
+	// for the new version, in which case nothing is published but the
+	// working value is unchanged so you can try again later.
+	[[nodiscard]] auto try_publish(ez::nort_t) -> bool                 { auto lock = std::lock_guard{mutex_}; return published_value_.try_set(ez::nort, std::as_const(working_value_)); }
 private:
-	mutable std::mutex mutex_;
-	T working_value_;
-	ez::value<T, auto_gc> published_value_;
+	mutable detail::writer_mutex<Policies...> mutex_;
+	T working_value_{};
+	detail::sync_storage<T, auto_gc, Policies...> published_value_;
 };
 
-struct sync_signal {
-	auto get(ez::rt_t) const -> uint64_t { return value_; }
-	auto increment(ez::rt_t) -> void     { value_++; }
+// Only one thread increments the signal but any number may read it.
+struct alignas(cache_line_size) sync_signal {
+	auto get(ez::rt_t) const -> uint64_t { return value_.load(std::memory_order_acquire); }
+	auto increment(ez::rt_t) -> void     { value_.store(value_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
 private:
-	uint64_t value_ = 1;
+	std::atomic<uint64_t> value_ = 1;
+};
+
+namespace detail {
+
+// A sync which raises a flag whenever something is published.
+template <typename T, bool auto_gc, typename... Policies>
+struct flagging_sync : sync<T, auto_gc, Policies...> {
+	using base = sync<T, auto_gc, Policies...>;
+	using base::base;
+	auto publish(ez::nort_t) -> void {
+		base::publish(ez::nort);
+		unread_value_.store(true, std::memory_order_release);
+	}
+	auto set_publish(ez::nort_t, T value) -> void {
+		base::set_publish(ez::nort, std::move(value));
+		unread_value_.store(true, std::memory_order_release);
+	}
+	template <typename Fn>
+	auto update_publish(ez::nort_t, Fn fn) -> T {
+		auto value = base::update_publish(ez::nort, std::move(fn));
+		unread_value_.store(true, std::memory_order_release);
+		return value;
+	}
+	[[nodiscard]]
+	auto try_publish(ez::nort_t) -> bool {
+		if (!base::try_publish(ez::nort)) { return false; }
+		unread_value_.store(true, std::memory_order_release);
+		return true;
+	}
+protected:
+	std::atomic_bool unread_value_ = true;
 };
 
+} // detail
+
 // Holds the most recently fetched version of the most recently published
 // version of a value.
 // The published value is only fetched when the associated sync_signal is
@@ -194,45 +1165,104 @@ void audio_callback(...) {
 ---------------------------------------------------------------------- */
 // CAUTION:
 // This class assumes that there is exactly one simultaneous realtime
-// reader.
-// If you want to support multiple realtime readers you'll have to fork
-// and complicate this class, you smarty pants.
-template <typename T, bool auto_gc = false>
-struct signalled_sync : sync<T, auto_gc> {
+// reader. See shared_signalled_sync if you need more than that.
+template <typename T, bool auto_gc = false, typename... Policies>
+struct signalled_sync : detail::flagging_sync<T, auto_gc, Policies...> {
+	using base     = detail::flagging_sync<T, auto_gc, Policies...>;
+	using ref_type = typename base::ref_type;
 	signalled_sync(const sync_signal& signal) : signal_{&signal} {}
-	auto read(ez::rt_t) -> immutable<T>& {
-		if (unread_value_.load(std::memory_order_acquire)) {
+	signalled_sync(const sync_signal& signal, std::pmr::memory_resource* resource, size_t reserve = 0) : base{resource, reserve}, signal_{&signal} {}
+	auto read(ez::rt_t) -> ref_type& {
+		if (this->unread_value_.load(std::memory_order_acquire)) {
 			auto signal_value = signal_->get(ez::rt);
 			if (signal_value > local_signal_value_) {
 				local_signal_value_ = signal_value;
-				signalled_value_    = sync<T, auto_gc>::read(ez::rt);
-				unread_value_.store(false, std::memory_order_release);
+				signalled_value_    = base::read(ez::rt);
+				this->unread_value_.store(false, std::memory_order_release);
 			}
 		}
 		return signalled_value_;
 	}
-	auto publish(ez::nort_t) -> void {
-		sync<T, auto_gc>::publish(ez::nort);
-		unread_value_.store(true, std::memory_order_release);
-	}
-	auto set_publish(ez::nort_t, T value) -> void {
-		sync<T, auto_gc>::set_publish(ez::nort, std::move(value));
-		unread_value_.store(true, std::memory_order_release);
-	}
 	[[nodiscard]]
-	auto read(detail::published_t anno) -> immutable<T> {
-		unread_value_.store(false, std::memory_order_release);
-		return sync<T, auto_gc>::read(anno);
+	auto read(detail::published_t anno) -> ref_type {
+		this->unread_value_.store(false, std::memory_order_release);
+		return base::read(anno);
 	}
 	[[nodiscard]]
 	auto is_unread(ez::safe_t) const -> bool {
-		return unread_value_.load(std::memory_order_acquire);
+		return this->unread_value_.load(std::memory_order_acquire);
 	}
 private:
 	const sync_signal* signal_;
 	uint64_t local_signal_value_ = 0;
-	immutable<T> signalled_value_;
-	std::atomic_bool unread_value_ = true;
+	ref_type signalled_value_;
+};
+
+// Like signalled_sync, but any number of realtime threads can read at the
+// same time, e.g. a pool of workers processing one audio block between
+// them.
+// The first reader to call read() after the signal is incremented fetches
+// the published value on behalf of everybody, so there is only ever one
+// fetch per signal increment however many readers there are. The readers
+// all share that one version without touching any reference counts.
+// A reader which arrives while the fetch is in progress spins until it is
+// done. The fetch is only a few instructions long but if the fetching
+// thread gets preempted then the others will be spinning for a while. If
+// possible, call read() once from the thread which increments the signal,
+// right after incrementing it, so the fetch is always finished before any
+// of the other readers get there.
+// The reference returned by read() is valid until the signal has been
+// incremented twice more. In other words a reader can still be working on
+// the previous block while the others move on to the next one, but not on
+// the one before that.
+template <typename T, bool auto_gc = false, typename... Policies>
+struct shared_signalled_sync : detail::flagging_sync<T, auto_gc, Policies...> {
+	using base     = detail::flagging_sync<T, auto_gc, Policies...>;
+	using ref_type = typename base::ref_type;
+	shared_signalled_sync(const sync_signal& signal) : signal_{&signal} {}
+	shared_signalled_sync(const sync_signal& signal, std::pmr::memory_resource* resource, size_t reserve = 0) : base{resource, reserve}, signal_{&signal} {}
+	auto read(ez::rt_t) -> const ref_type& {
+		const auto signal_value = signal_->get(ez::rt);
+		for (;;) {
+			auto state = state_.load(std::memory_order_acquire);
+			if (state & BUSY) {
+				detail::cpu_relax();
+				continue;
+			}
+			if ((state >> 1) >= signal_value) {
+				break;
+			}
+			if (state_.compare_exchange_weak(state, (signal_value << 1) | BUSY, std::memory_order_acquire, std::memory_order_relaxed)) {
+				fetch();
+				state_.store(signal_value << 1, std::memory_order_release);
+				break;
+			}
+		}
+		return snapshots_[current_.load(std::memory_order_acquire)];
+	}
+	[[nodiscard]]
+	auto is_unread(ez::safe_t) const -> bool {
+		return this->unread_value_.load(std::memory_order_acquire);
+	}
+private:
+	static constexpr uint64_t BUSY = 1;
+	auto fetch() -> void {
+		if (!this->unread_value_.exchange(false, std::memory_order_acq_rel)) { return; }
+		// Fetch into the slot that isn't current. Anyone still using it is
+		// at least two signal increments behind.
+		const auto next = 1 - current_.load(std::memory_order_relaxed);
+		snapshots_[next] = base::read(ez::rt);
+		// A reader which got past the state check before this fetch started
+		// can still load the new index, so the index has to carry the
+		// snapshot with it rather than relying on state_.
+		current_.store(next, std::memory_order_release);
+	}
+	const sync_signal* signal_;
+	// The signal value of the most recent fetch, shifted left by one, with
+	// the low bit set while a fetch is in progress.
+	std::atomic<uint64_t> state_ = 0;
+	std::atomic<int> current_    = 0;
+	std::array<ref_type, 2> snapshots_;
 };
 
 // This is like signalled_sync, except instead of holding only the most
@@ -242,7 +1272,7 @@ private:
 // changes, crossfades-out the old project state while crossfading-in the
 // new project state. This can be set up with N==2 and ping-ponging between
 // the two value slots.
-template <typename T, size_t N, bool auto_gc = false>
+template <typename T, size_t N, bool auto_gc = false, typename... Policies>
 struct signalled_sync_array {
 	signalled_sync_array(const sync_signal& signal) : ss_{signal} {}
 	[[nodiscard]] auto is_unread(ez::safe_t) const -> bool { return ss_.is_unread(ez::safe); }
@@ -250,8 +1280,188 @@ struct signalled_sync_array {
 	auto read_into(ez::rt_t, size_t slot) -> const T&      { assert (slot >= 0 && slot < N); return *(array_[slot] = ss_.read(ez::rt)); }
 	auto set_publish(ez::nort_t, T value) -> void          { ss_.set_publish(ez::nort, std::move(value)); }
 private:
-	ez::signalled_sync<T, auto_gc> ss_;
-	std::array<immutable<T>, N> array_;
+	ez::signalled_sync<T, auto_gc, Policies...> ss_;
+	std::array<typename ez::signalled_sync<T, auto_gc, Policies...>::ref_type, N> array_;
+};
+
+namespace detail {
+
+// What a delta_signalled_sync actually publishes. 'deltas' are the most
+// recent changes, oldest first, and the last one of them is change number
+// 'seq'.
+template <typename T, typename Delta>
+struct delta_version {
+	T value;
+	std::vector<Delta> deltas;
+	uint64_t seq = 0;
+};
+
+} // detail
+
+// Like signalled_sync, but each change can come with a user-defined
+// description of what changed, e.g. "track 3 was removed", and the reader
+// is handed the list of changes since the last time it read, so it can
+// update its own caches in proportion to the number of changes rather than
+// diffing the old and new versions itself.
+// If a change was made without a delta, or the reader has fallen more than
+// MaxDeltas changes behind, then resync() is true and the reader should
+// rebuild whatever it has from value() instead. That is also the case for
+// the first read.
+// Only the last MaxDeltas deltas are kept, and they are copied along with
+// each published version, so deltas should be small.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::sync_signal signal;
+static ez::delta_signalled_sync<Tracks, TrackChange> tracks{signal};
+
+void ui_thread() {
+	tracks.update_publish(ez::ui, [](Tracks&& x) { x.remove(3); return x; }, TrackChange{TrackChange::removed, 3});
+}
+
+void audio_callback(...) {
+	signal.increment(ez::audio);
+	const auto view = tracks.read(ez::audio);
+	if (view.resync()) { rebuild_cache(view.value()); }
+	else               { for (const auto& change : view.deltas()) { apply(change); } }
+}
+---------------------------------------------------------------------- */
+// CAUTION:
+// Like signalled_sync, there must be exactly one realtime reader. Each delta
+// is delivered once, so if read() is called again before anything new has
+// been fetched then there are no deltas in the view. The view is valid
+// until the next call to read().
+template <typename T, typename Delta, size_t MaxDeltas = 16, bool auto_gc = false, typename... Policies>
+struct delta_signalled_sync {
+	static_assert(MaxDeltas > 0);
+	using value_type = T;
+	using version    = detail::delta_version<T, Delta>;
+	struct view {
+		[[nodiscard]] auto value() const -> const T&               { return *value_; }
+		[[nodiscard]] auto deltas() const -> std::span<const Delta> { return deltas_; }
+		[[nodiscard]] auto resync() const -> bool                   { return resync_; }
+	private:
+		const T* value_;
+		std::span<const Delta> deltas_;
+		bool resync_;
+		friend struct delta_signalled_sync;
+	};
+	delta_signalled_sync(const sync_signal& signal) : sync_{signal} {}
+	delta_signalled_sync(const sync_signal& signal, std::pmr::memory_resource* resource, size_t reserve = 0) : sync_{signal, resource, reserve} {}
+	[[nodiscard]] auto is_unread(ez::safe_t) const -> bool { return sync_.is_unread(ez::safe); }
+	[[nodiscard]] auto read(ez::nort_t) const -> T          { return sync_.read(ez::nort).value; }
+	auto gc(ez::gc_t) -> void                               { sync_.gc(ez::gc); }
+	auto publish(ez::nort_t) -> void                        { sync_.publish(ez::nort); }
+	// Changes without a delta make the reader resync.
+	auto set(ez::nort_t, T value) -> void                   { sync_.update(ez::nort, [&value](version&& v) { v.value = std::move(value); gap(&v); return std::move(v); }); }
+	auto set_publish(ez::nort_t, T value) -> void           { sync_.update_publish(ez::nort, [&value](version&& v) { v.value = std::move(value); gap(&v); return std::move(v); }); }
+	template <typename Fn> auto update(ez::nort_t, Fn fn) -> T         { return sync_.update(ez::nort, [&fn](version&& v) { v.value = fn(std::move(v.value)); gap(&v); return std::move(v); }).value; }
+	template <typename Fn> auto update_publish(ez::nort_t, Fn fn) -> T { return sync_.update_publish(ez::nort, [&fn](version&& v) { v.value = fn(std::move(v.value)); gap(&v); return std::move(v); }).value; }
+	// Changes with a delta. Deltas made by several updates before a
+	// publish are all delivered, in order.
+	auto set(ez::nort_t, T value, Delta delta) -> void         { sync_.update(ez::nort, [&](version&& v) { v.value = std::move(value); push(&v, std::move(delta)); return std::move(v); }); }
+	auto set_publish(ez::nort_t, T value, Delta delta) -> void { sync_.update_publish(ez::nort, [&](version&& v) { v.value = std::move(value); push(&v, std::move(delta)); return std::move(v); }); }
+	template <typename Fn> auto update(ez::nort_t, Fn fn, Delta delta) -> T         { return sync_.update(ez::nort, [&](version&& v) { v.value = fn(std::move(v.value)); push(&v, std::move(delta)); return std::move(v); }).value; }
+	template <typename Fn> auto update_publish(ez::nort_t, Fn fn, Delta delta) -> T { return sync_.update_publish(ez::nort, [&](version&& v) { v.value = fn(std::move(v.value)); push(&v, std::move(delta)); return std::move(v); }).value; }
+	auto read(ez::rt_t) -> view {
+		const auto& v = *sync_.read(ez::rt);
+		view out;
+		out.value_  = &v.value;
+		out.resync_ = false;
+		if (!seen_ || v.seq - last_seq_ > v.deltas.size()) {
+			out.resync_ = true;
+		}
+		else {
+			const auto count = size_t(v.seq - last_seq_);
+			out.deltas_ = std::span{v.deltas}.last(count);
+		}
+		seen_     = true;
+		last_seq_ = v.seq;
+		return out;
+	}
+private:
+	// A change which the reader can't be told about, so anyone who hasn't
+	// seen everything up to here has to resync.
+	static auto gap(version* v) -> void {
+		v->deltas.clear();
+		v->seq++;
+	}
+	static auto push(version* v, Delta&& delta) -> void {
+		if (v->deltas.size() == MaxDeltas) { v->deltas.erase(v->deltas.begin()); }
+		v->deltas.push_back(std::move(delta));
+		v->seq++;
+	}
+	ez::signalled_sync<version, auto_gc, Policies...> sync_;
+	// Reader only.
+	bool seen_         = false;
+	uint64_t last_seq_ = 0;
+};
+
+namespace detail {
+
+struct empty {};
+
+// One entry in a block_snapshot.
+template <typename Sync>
+struct block_pin {
+	using read_result = decltype(std::declval<Sync&>().read(ez::rt));
+	// The signalled syncs hold on to what they return until the signal is
+	// incremented, so there is no need to take another reference.
+	static constexpr bool borrowed = std::is_lvalue_reference_v<read_result>;
+	using ref_type = std::conditional_t<borrowed, empty, std::remove_cvref_t<read_result>>;
+	block_pin(Sync& sync) requires borrowed    : value{&*sync.read(ez::rt)} {}
+	block_pin(Sync& sync) requires (!borrowed) : ref{sync.read(ez::rt)}, value{&*ref} {}
+	[[no_unique_address]] ref_type ref;
+	const typename Sync::value_type* value;
+};
+
+} // detail
+
+// Reads a bunch of syncs once, at the start of an audio block, and then
+// gives out plain references to the values until it goes out of scope, so
+// an inner loop which looks at the same parameters thousands of times
+// doesn't keep going back through the syncs.
+// This works with any mixture of sync, signalled_sync and
+// shared_signalled_sync. The signalled ones only change when the
+// sync_signal is incremented, so create the snapshot after incrementing it.
+// Example:
+/* ----------------------------------------------------------------------
+static ez::sync_signal signal;
+static ez::signalled_sync<Params> params{signal};
+static ez::sync<Routing> routing;
+
+void audio_callback(...) {
+	signal.increment(ez::audio);
+	const auto snap = ez::block_snapshot{ez::audio, params, routing};
+	const auto& [p, r] = snap;
+	for (...) {
+		// p and r are const Params& and const Routing&.
+	}
+}
+---------------------------------------------------------------------- */
+// CAUTION:
+// The references are only valid for as long as the snapshot exists, and
+// for a signalled sync, only until the signal is incremented again. Don't
+// hang on to them for longer than one block.
+template <typename... Syncs>
+struct block_snapshot {
+	block_snapshot(ez::rt_t, Syncs&... syncs) : pins_{syncs...} {}
+	block_snapshot(const block_snapshot&) = delete;
+	block_snapshot& operator=(const block_snapshot&) = delete;
+	template <size_t I> [[nodiscard]]
+	auto get() const -> const typename std::tuple_element_t<I, std::tuple<Syncs...>>::value_type& { return *std::get<I>(pins_).value; }
+private:
+	std::tuple<detail::block_pin<Syncs>...> pins_;
 };
 
+template <typename... Syncs>
+block_snapshot(ez::rt_t, Syncs&...) -> block_snapshot<Syncs...>;
+
 } // ez
+
+template <typename... Syncs>
+struct std::tuple_size<ez::block_snapshot<Syncs...>> : std::integral_constant<size_t, sizeof...(Syncs)> {};
+
+template <size_t I, typename... Syncs>
+struct std::tuple_element<I, ez::block_snapshot<Syncs...>> {
+	using type = const typename std::tuple_element_t<I, std::tuple<Syncs...>>::value_type;
+};